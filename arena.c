@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define BLOCK_SIZE  (2 << 20)       // Smallest block. One huge page.
+
+struct arena_block {
+    struct arena_block* next;
+    size_t              size;       // Whole mapping, this header included.
+    size_t              used;
+};
+
+
+static struct arena_block* new_block(struct arena* arena, size_t want)
+{
+    size_t size = (want + sizeof(struct arena_block) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t offset;
+    void* mem = MAP_FAILED;
+
+    if (arena->huge) {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            arena->huge_blocks++;
+        }
+    }
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        if (arena->huge) {
+            // No huge pages reserved. Transparent ones are the next best thing.
+            madvise(mem, size, MADV_HUGEPAGE);
+        }
+    }
+
+    // First touch places the pages on the NUMA node this thread is on now. Only
+    // a pinned thread stays there.
+    for (offset = 0; offset < size; offset += page) {
+        ((volatile unsigned char*)mem)[offset] = 0;
+    }
+
+    struct arena_block* block = mem;
+    block->next = arena->blocks;
+    block->size = size;
+    block->used = sizeof(struct arena_block);
+    arena->blocks = block;
+    arena->mapped += size;
+    arena->n_blocks++;
+    return block;
+}
+
+void* arena_alloc_aligned(struct arena* arena, size_t size, size_t align)
+{
+    struct arena_block* block = arena->blocks;
+    uintptr_t start;
+
+    if (!block || (((uintptr_t)block + block->used + align - 1) & ~(align - 1)) + size >
+            (uintptr_t)block + block->size) {
+        block = new_block(arena, size + align);
+    }
+    start = ((uintptr_t)block + block->used + align - 1) & ~(align - 1);
+    block->used = start + size - (uintptr_t)block;
+
+    arena->allocs++;
+    arena->total_allocs++;
+    arena->bytes += size;
+    return (void*)start;
+}
+
+void* arena_alloc(struct arena* arena, size_t size)
+{
+    return arena_alloc_aligned(arena, size, ARENA_ALIGN);
+}
+
+void arena_free(struct arena* arena)
+{
+    while (arena->blocks) {
+        struct arena_block* next = arena->blocks->next;
+        munmap(arena->blocks, arena->blocks->size);
+        arena->blocks = next;
+    }
+    arena->allocs = 0;
+    arena->bytes = 0;
+    arena->mapped = 0;
+    arena->n_blocks = 0;
+    arena->huge_blocks = 0;
+}
+
+void arena_report(FILE* fp, const struct arena* arena)
+{
+    fprintf(fp, "%-12s allocs=%-6lu total=%-6lu bytes=%zu mapped=%zu blocks=%lu huge=%lu\n", arena->name,
+            arena->allocs, arena->total_allocs, arena->bytes, arena->mapped, arena->n_blocks, arena->huge_blocks);
+}
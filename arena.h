@@ -0,0 +1,50 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define ARENA_ALIGN 64              // Cache line. Also enough for any SIMD load.
+
+/* A bump allocator over blocks from mmap(). Everything in it is freed at once
+ * with arena_free(). Blocks are touched when they are mapped, so they land on
+ * the NUMA node the creating thread is running on at the time. That is only
+ * the node it keeps running on if the thread is pinned, eg. by --cpu. */
+struct arena_block;
+
+struct arena {
+    const char*         name;
+    int                 huge;               // Try 2MB pages for new blocks.
+    struct arena_block* blocks;             // Newest first.
+    unsigned long       allocs;             // arena_alloc() calls since arena_free().
+    unsigned long       total_allocs;       // arena_alloc() calls ever.
+    size_t              bytes;              // Allocated since arena_free().
+    size_t              mapped;             // Mapped since arena_free().
+    unsigned long       n_blocks;
+    unsigned long       huge_blocks;        // Blocks that got MAP_HUGETLB.
+};
+
+/* arena_alloc: Allocate zeroed memory aligned to ARENA_ALIGN. Exits when out of memory.
+ * Arguments:
+ *      (struct arena*)arena: Arena to allocate from.
+ *      (size_t)size:         Bytes wanted.
+ */
+void* arena_alloc(struct arena* arena, size_t size);
+
+/* arena_alloc_aligned: As arena_alloc() with a larger alignment, eg. a page.
+ * Arguments:
+ *      (size_t)align: Power of 2, at least ARENA_ALIGN.
+ */
+void* arena_alloc_aligned(struct arena* arena, size_t size, size_t align);
+
+/* arena_free: Unmap every block. The arena can be used again afterwards. */
+void arena_free(struct arena* arena);
+
+/* arena_report: Print one line of allocation counts for an arena.
+ * Arguments:
+ *      (FILE*)fp:              Where to print.
+ *      (struct arena*)arena:   Arena to print.
+ */
+void arena_report(FILE* fp, const struct arena* arena);
+
+#endif  // ARENA_H
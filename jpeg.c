@@ -1,9 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "jpeglib.h"
 
 #include "jpeg.h"
+#include "pool.h"
 
 
 void strreverse(char* begin, char* end) {
@@ -32,39 +40,115 @@ void itoa(int value, char* str, int base) {
     strreverse(str,wstr-1);
 }
 
-unsigned long jpeg_file_size(char* filename){
-    FILE* fp = fopen(filename, "rb");
-    if (!fp){
-        fprintf(stderr,"ERROR, could not read file.\n");
-        return 0;
+const unsigned char* jpeg_file_map(const char* filename, unsigned long* size)
+{
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n", filename, errno, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Cannot size '%s'\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "Cannot map '%s': %d, %s\n", filename, errno, strerror(errno));
+        return NULL;
     }
+    *size = st.st_size;
+    return mem;
+}
 
-    //Get file length
-    fseek(fp, 0, SEEK_END);
-    unsigned long fileLen=ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+void jpeg_file_unmap(const unsigned char* mem, unsigned long size)
+{
+    munmap((void*)mem, size);
+}
 
-    fclose(fp);
+/* libjpeg calls error_exit() on corrupt data. Jump back out instead of exiting
+ * so one bad file does not end a batch. */
+struct decode_error {
+    struct jpeg_error_mgr   mgr;
+    jmp_buf                 escape;
+};
 
-    return fileLen;
+static void decode_error_exit(j_common_ptr cinfo)
+{
+    struct decode_error* err = (struct decode_error*)cinfo->err;
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(err->escape, 1);
 }
 
-int jpeg_file_get(char* filename, char *buffer, unsigned long fileLen){
-    FILE* fp;
-    fp = fopen(filename, "rb");
-    if (!fp){
-        fprintf(stderr,"ERROR, could not read file.\n");
+int read_JPEG_size(const unsigned char* mem, unsigned long size, int* width, int* height)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct decode_error err;
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = decode_error_exit;
+    if (setjmp(err.escape)) {
+        jpeg_destroy_decompress(&cinfo);
         return -1;
     }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)mem, size);
+    jpeg_read_header(&cinfo, TRUE);
+    *width = cinfo.image_width;
+    *height = cinfo.image_height;
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+}
+
+unsigned char* decompress_JPEG_mem(const unsigned char* mem, unsigned long size, int denom, int* width,
+                                   int* height)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct decode_error err;
+    unsigned char* volatile image = NULL;
+    JSAMPROW row_pointer[1];
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = decode_error_exit;
+    if (setjmp(err.escape)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(image);
+        return NULL;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)mem, size);
+    jpeg_read_header(&cinfo, TRUE);
 
-    long int read_len = fread(buffer, sizeof(char), fileLen, fp);
-    fprintf(stderr, "read %li bytes out of %li\n\n", read_len, fileLen);
-    fclose(fp);
+    // Let the IDCT do the downscaling. Much cheaper than decoding every pixel.
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.dct_method = JDCT_IFAST;
+    jpeg_start_decompress(&cinfo);
+
+    int row_stride = cinfo.output_width * cinfo.output_components;
+    image = malloc(row_stride * cinfo.output_height);
+    if (!image) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    while (cinfo.output_scanline < cinfo.output_height) {
+        row_pointer[0] = &image[cinfo.output_scanline * row_stride];
+        (void) jpeg_read_scanlines(&cinfo, row_pointer, 1);
+    }
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
 
-    return read_len;
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return image;
 }
 
-void write_JPEG_file(char* filename, unsigned char* p_image_buffer, int image_width, int image_height, int num_of_col)
+void write_JPEG_file(char* filename, unsigned char* p_image_buffer, int image_width, int image_height, int num_of_col,
+                     int quality)
 {
     // JPEG object
     struct jpeg_compress_struct cinfo;
@@ -102,7 +186,7 @@ void write_JPEG_file(char* filename, unsigned char* p_image_buffer, int image_wi
     jpeg_set_defaults(&cinfo);
 
     // set any non default cinfo peramiters.
-    jpeg_set_quality(&cinfo, 70, TRUE /* limit to baseline-JPEG values */);
+    jpeg_set_quality(&cinfo, quality, TRUE /* limit to baseline-JPEG values */);
 
     jpeg_start_compress(&cinfo, TRUE);
     int row_stride = image_width * num_of_col;
@@ -116,3 +200,215 @@ void write_JPEG_file(char* filename, unsigned char* p_image_buffer, int image_wi
     //free(mem);
     jpeg_destroy_compress(&cinfo);
 }
+
+// One horizontal slice of compress_JPEG_mem().
+struct jpeg_slice {
+    unsigned char*  image;          // First pixel of the slice.
+    int             height;
+    unsigned char*  mem;            // Compressed slice. A complete Jpeg.
+    unsigned long   mem_size;
+};
+
+struct jpeg_slice_job {
+    struct jpeg_slice*  slices;
+    int                 image_width;
+    int                 num_of_col;
+    int                 quality;
+    int                 restart;        // Restart marker after every MCU row.
+};
+
+/* Set up cinfo the same way for every slice, so the tables match. */
+static void slice_defaults(struct jpeg_compress_struct* cinfo, int image_width, int image_height, int num_of_col,
+                           int quality, int restart)
+{
+    cinfo->image_width = image_width;
+    cinfo->image_height = image_height;
+    cinfo->input_components = num_of_col;
+    cinfo->in_color_space = (num_of_col == 3) ? JCS_RGB : JCS_GRAYSCALE;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, quality, TRUE /* limit to baseline-JPEG values */);
+    cinfo->restart_in_rows = restart;
+}
+
+static void compress_slice(void* arg, int i)
+{
+    struct jpeg_slice_job* job = arg;
+    struct jpeg_slice* slice = &job->slices[i];
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row_pointer[1];
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    slice->mem = NULL;
+    slice->mem_size = 0;
+    jpeg_mem_dest(&cinfo, &slice->mem, &slice->mem_size);
+
+    slice_defaults(&cinfo, job->image_width, slice->height, job->num_of_col, job->quality, job->restart);
+    jpeg_start_compress(&cinfo, TRUE);
+    int row_stride = job->image_width * job->num_of_col;
+    while (cinfo.next_scanline < cinfo.image_height) {
+        row_pointer[0] = &slice->image[cinfo.next_scanline * row_stride];
+        (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+}
+
+/* Offset of the first entropy coded byte, just past the SOS header.
+ * Also returns the offset of the SOF0 image height in *height_at. */
+static unsigned long scan_start(const unsigned char* mem, unsigned long size, unsigned long* height_at)
+{
+    unsigned long pos = 2;          // Past SOI.
+
+    while (pos + 4 <= size && mem[pos] == 0xFF) {
+        unsigned char marker = mem[pos + 1];
+        unsigned long length = (mem[pos + 2] << 8) | mem[pos + 3];
+        if (marker == 0xC0) {
+            *height_at = pos + 5;
+        }
+        pos += 2 + length;
+        if (marker == 0xDA) {
+            return pos;
+        }
+    }
+    fprintf(stderr, "Jpeg slice has no scan\n");
+    exit(1);
+}
+
+unsigned long compress_JPEG_mem(unsigned char** mem, unsigned char* p_image_buffer, int image_width,
+                                int image_height, int num_of_col, int quality, int slices)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    int i, mcu_height, mcu_rows;
+
+    // Work out the MCU height libjpeg will use for these settings.
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    slice_defaults(&cinfo, image_width, image_height, num_of_col, quality, 0);
+    mcu_height = cinfo.comp_info[0].v_samp_factor * DCTSIZE;
+    jpeg_destroy_compress(&cinfo);
+
+    mcu_rows = (image_height + mcu_height - 1) / mcu_height;
+    if (slices > mcu_rows) {
+        slices = mcu_rows;
+    }
+    if (slices < 1) {
+        slices = 1;
+    }
+
+    // Every slice but the last is a whole number of MCU rows.
+    struct jpeg_slice slice[slices];
+    struct jpeg_slice_job job = { slice, image_width, num_of_col, quality, slices > 1 };
+    int row = 0;
+    for (i = 0; i < slices; i++) {
+        int rows = (mcu_rows * (i + 1)) / slices - (mcu_rows * i) / slices;
+        slice[i].image = p_image_buffer + (size_t)row * image_width * num_of_col;
+        slice[i].height = rows * mcu_height;
+        if (row + slice[i].height > image_height) {
+            slice[i].height = image_height - row;
+        }
+        row += slice[i].height;
+    }
+
+    if (slices == 1) {
+        compress_slice(&job, 0);
+        *mem = slice[0].mem;
+        return slice[0].mem_size;
+    }
+
+    pool_run(compress_slice, &job, slices);
+
+    // Headers come from the first slice, with the height of the whole image.
+    unsigned long height_at = 0;
+    unsigned long start[slices];
+    unsigned long size = 2 * slices;                // Restart markers between slices and EOI.
+    for (i = 0; i < slices; i++) {
+        start[i] = scan_start(slice[i].mem, slice[i].mem_size, &height_at);
+        size += slice[i].mem_size - 2 - (i ? start[i] : 0);
+        if (!i) {
+            slice[0].mem[height_at] = image_height >> 8;
+            slice[0].mem[height_at + 1] = image_height & 0xFF;
+        }
+    }
+
+    unsigned char* out = malloc(size);
+    if (!out) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memcpy(out, slice[0].mem, start[0]);
+    unsigned long out_size = start[0];
+
+    // Entropy coded data of every slice. Restart markers count 0 to 7 across
+    // the whole image so they are renumbered as slices are joined.
+    int restart = 0;
+    for (i = 0; i < slices; i++) {
+        unsigned long pos, end = slice[i].mem_size - 2;     // Up to EOI.
+        if (i) {
+            out[out_size++] = 0xFF;
+            out[out_size++] = 0xD0 + (restart++ & 7);
+        }
+        for (pos = start[i]; pos + 1 < end; pos++) {
+            if (slice[i].mem[pos] == 0xFF && (slice[i].mem[pos + 1] & 0xF8) == 0xD0) {
+                slice[i].mem[pos + 1] = 0xD0 + (restart++ & 7);
+                pos++;
+            }
+        }
+        memcpy(out + out_size, slice[i].mem + start[i], end - start[i]);
+        out_size += end - start[i];
+        free(slice[i].mem);
+    }
+    out[out_size++] = 0xFF;
+    out[out_size++] = 0xD9;
+
+    *mem = out;
+    return out_size;
+}
+
+unsigned long compress_JPEG_crop(unsigned char** mem, const unsigned char* image, int image_width, int x, int y,
+                                 int width, int height, int quality, const char* comment)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row_pointer[1];
+    unsigned long mem_size = 0;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    *mem = NULL;
+    jpeg_mem_dest(&cinfo, mem, &mem_size);
+
+    slice_defaults(&cinfo, width, height, 3, quality, 0);
+    jpeg_start_compress(&cinfo, TRUE);
+    if (comment) {
+        jpeg_write_marker(&cinfo, JPEG_COM, (const JOCTET*)comment, strlen(comment));
+    }
+    // Rows of the crop are read straight out of the whole image.
+    const unsigned char* first = image + ((size_t)y * image_width + x) * 3;
+    while (cinfo.next_scanline < cinfo.image_height) {
+        row_pointer[0] = (JSAMPROW)&first[(size_t)cinfo.next_scanline * image_width * 3];
+        (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return mem_size;
+}
+
+void write_JPEG_file_sliced(char* filename, unsigned char* p_image_buffer, int image_width, int image_height,
+                            int num_of_col, int quality, int slices)
+{
+    unsigned char* mem;
+    unsigned long size = compress_JPEG_mem(&mem, p_image_buffer, image_width, image_height, num_of_col,
+                                           quality, slices);
+
+    FILE * outfile;
+    if ((outfile = fopen(filename, "wb")) == NULL) {
+        fprintf(stderr, "can't open %s\n", filename);
+        exit(1);
+    }
+    fwrite(mem, 1, size, outfile);
+    fclose(outfile);
+    free(mem);
+}
@@ -12,23 +12,87 @@
  */
 void itoa(int value, char* str, int base);
 
-/* jpeg_file_size: Get size (in bytes) of Jpeg file.
+/* jpeg_file_map: Map a Jpeg file read only. One open, no copy.
  * Arguments:
- *      (char*)filename: Pointer to name of file.
+ *      (char*)filename:        Name of file.
+ *      (unsigned long*)size:   Set to the length of the file.
+ * Returns:
+ *      (unsigned char*): The file contents. NULL == failure.
+ */
+const unsigned char* jpeg_file_map(const char* filename, unsigned long* size);
+
+/* jpeg_file_unmap: Release a jpeg_file_map() mapping. */
+void jpeg_file_unmap(const unsigned char* mem, unsigned long size);
+
+/* read_JPEG_size: Read the image size from a Jpeg header.
+ * Arguments:
+ *      (unsigned char*)mem:   Jpeg data.
+ *      (unsigned long)size:   Bytes of Jpeg data.
+ *      (int*)width:           Set to the width in pixels.
+ *      (int*)height:          Set to the height in pixels.
+ * Returns:
+ *      (int): -1 == not a readable Jpeg. Otherwise 0.
  */
-unsigned long jpeg_file_size(char* filename);
+int read_JPEG_size(const unsigned char* mem, unsigned long size, int* width, int* height);
 
-/* jpeg_file_get: Load Jpeg file into buffer.
+/* decompress_JPEG_mem: Decode a Jpeg to RGB888, scaled down in the IDCT.
  * Arguments:
- *      (char*)filename: Pointer to name of file.
- *      (char*)buffer:   Buffer to be populated with Jpeg data.
- *      (unsigned long)fileLen: Expected length of file.
+ *      (unsigned char*)mem:   Jpeg data.
+ *      (unsigned long)size:   Bytes of Jpeg data.
+ *      (int)denom:            Scale the image by 1/denom. 1, 2, 4 or 8.
+ *      (int*)width:           Set to the width of the decoded image.
+ *      (int*)height:          Set to the height of the decoded image.
  * Returns:
- *      (int): -1 == failure.
- *              Otherwise, returns number of bytes read from file.
+ *      (unsigned char*): 3 bytes per pixel. Caller frees. NULL == corrupt Jpeg.
  */
-int jpeg_file_get(char* filename, char *buffer, unsigned long fileLen);
+unsigned char* decompress_JPEG_mem(const unsigned char* mem, unsigned long size, int denom, int* width,
+                                   int* height);
 
-void write_JPEG_file(char* filename, unsigned char* p_image_buffer, int image_width, int image_height, int num_of_col);
+/* write_JPEG_file: Compress an image to a baseline Jpeg file.
+ * Arguments:
+ *      (char*)filename:               Name of file to write.
+ *      (unsigned char*)p_image_buffer: RGB888 or 8 bit grey pixels.
+ *      (int)image_width:               Width in pixels.
+ *      (int)image_height:              Height in pixels.
+ *      (int)num_of_col:                3 for RGB, 1 for grey.
+ *      (int)quality:                   Jpeg quality. 0 to 100.
+ */
+void write_JPEG_file(char* filename, unsigned char* p_image_buffer, int image_width, int image_height, int num_of_col,
+                     int quality);
+
+/* write_JPEG_file_sliced: As write_JPEG_file() but splits the image into
+ * horizontal slices of whole MCU rows, compresses them in parallel on the
+ * worker pool and joins them with restart markers into one baseline Jpeg.
+ * Arguments:
+ *      As write_JPEG_file(), plus
+ *      (int)slices: Number of slices. 1 == same as write_JPEG_file().
+ */
+void write_JPEG_file_sliced(char* filename, unsigned char* p_image_buffer, int image_width, int image_height,
+                            int num_of_col, int quality, int slices);
+
+/* compress_JPEG_mem: As write_JPEG_file_sliced() but into memory.
+ * Arguments:
+ *      (unsigned char**)mem: Set to the compressed image. Caller frees.
+ *      The rest as write_JPEG_file_sliced().
+ * Returns:
+ *      (unsigned long): Size of the compressed image in bytes.
+ */
+unsigned long compress_JPEG_mem(unsigned char** mem, unsigned char* p_image_buffer, int image_width,
+                                int image_height, int num_of_col, int quality, int slices);
+
+/* compress_JPEG_crop: Compress a rectangle of an RGB888 image into memory, in place.
+ * Arguments:
+ *      (unsigned char**)mem:   Set to the compressed crop. Caller frees.
+ *      (unsigned char*)image:  Whole image, 3 bytes per pixel.
+ *      (int)image_width:       Width of the whole image in pixels.
+ *      (int)x, (int)y:         Top left of the crop.
+ *      (int)width, (int)height: Size of the crop.
+ *      (int)quality:           Jpeg quality. 0 to 100.
+ *      (char*)comment:         Stored in a COM marker. NULL == none.
+ * Returns:
+ *      (unsigned long): Size of the compressed crop in bytes.
+ */
+unsigned long compress_JPEG_crop(unsigned char** mem, const unsigned char* image, int image_width, int x, int y,
+                                 int width, int height, int quality, const char* comment);
 
 #endif  // JPEG_H
@@ -0,0 +1,411 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "kernels.h"
+
+
+void yuyv_to_luma(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    for (; i + 16 <= pixels; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i * 2 + 16));
+        a = _mm_and_si128(a, mask);
+        b = _mm_and_si128(b, mask);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i < pixels; i++) {
+        dst[i] = src[i * 2];
+    }
+}
+
+#define CLAMP8(x) ( (x) > 255 ? 255 : ( (x) < 0 ? 0 : (x) ) )
+
+/* One pixel of BT.601 YCbCr to RGB. 1.402, 0.344, 0.714 and 1.772 times 1024, rounded. */
+static inline void yuv_pixel(int y, int u, int v, unsigned char* dst)
+{
+    u -= 128;
+    v -= 128;
+    dst[0] = CLAMP8(y + ((1436 * v + 512) >> 10));
+    dst[1] = CLAMP8(y - ((352 * u + 731 * v + 512) >> 10));
+    dst[2] = CLAMP8(y + ((1815 * u + 512) >> 10));
+}
+
+void nv12_to_rgb(int width, int height, const unsigned char* y, int y_stride, const unsigned char* uv,
+                 int uv_stride, unsigned char* dst)
+{
+    int row, col;
+    for (row = 0; row < height; row++) {
+        const unsigned char* y_row = y + row * y_stride;
+        const unsigned char* uv_row = uv + (row >> 1) * uv_stride;
+        for (col = 0; col < width; col++) {
+            yuv_pixel(y_row[col], uv_row[col & ~1], uv_row[col | 1], dst);
+            dst += 3;
+        }
+    }
+}
+
+void yuv420_to_rgb(int width, int height, const unsigned char* y, int y_stride, const unsigned char* u,
+                   const unsigned char* v, int uv_stride, unsigned char* dst)
+{
+    int row, col;
+    for (row = 0; row < height; row++) {
+        const unsigned char* y_row = y + row * y_stride;
+        const unsigned char* u_row = u + (row >> 1) * uv_stride;
+        const unsigned char* v_row = v + (row >> 1) * uv_stride;
+        for (col = 0; col < width; col++) {
+            yuv_pixel(y_row[col], u_row[col >> 1], v_row[col >> 1], dst);
+            dst += 3;
+        }
+    }
+}
+
+void grey_to_rgb(int width, int height, const unsigned char* y, int y_stride, unsigned char* dst)
+{
+    int row, col;
+    for (row = 0; row < height; row++) {
+        const unsigned char* y_row = y + row * y_stride;
+        for (col = 0; col < width; col++) {
+            dst[0] = dst[1] = dst[2] = y_row[col];
+            dst += 3;
+        }
+    }
+}
+
+void rgb_half(const unsigned char* src, int width, int height, unsigned char* dst)
+{
+    int row, col, c;
+    int stride = width * 3;
+
+    for (row = 0; row < height / 2; row++) {
+        const unsigned char* top = src + row * 2 * stride;
+        const unsigned char* bottom = top + stride;
+        for (col = 0; col < width / 2; col++) {
+            for (c = 0; c < 3; c++) {
+                *dst++ = (top[c] + top[c + 3] + bottom[c] + bottom[c + 3] + 2) >> 2;
+            }
+            top += 6;
+            bottom += 6;
+        }
+    }
+}
+
+/* Add the absolute differences of one row into sums of 8 columns. */
+static void sad_row_scalar(const unsigned char* prev, const unsigned char* cur, int from, int width,
+                           unsigned int* col8)
+{
+    int x;
+    for (x = from; x < width; x++) {
+        col8[x >> 3] += abs(prev[x] - cur[x]);
+    }
+}
+
+#ifdef __SSE2__
+static void sad_row_sse2(const unsigned char* prev, const unsigned char* cur, int width, unsigned int* col8)
+{
+    int x;
+    for (x = 0; x + 16 <= width; x += 16) {
+        // psadbw leaves the sum of each 8 byte half in the low word of each 64 bit lane.
+        __m128i v = _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(prev + x)),
+                                 _mm_loadu_si128((const __m128i*)(cur + x)));
+        col8[(x >> 3)]     += _mm_cvtsi128_si32(v);
+        col8[(x >> 3) + 1] += _mm_extract_epi16(v, 4);
+    }
+    sad_row_scalar(prev, cur, x, width, col8);
+}
+
+__attribute__((target("avx2")))
+static void sad_row_avx2(const unsigned char* prev, const unsigned char* cur, int width, unsigned int* col8)
+{
+    int x;
+    for (x = 0; x + 32 <= width; x += 32) {
+        __m256i v = _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(prev + x)),
+                                    _mm256_loadu_si256((const __m256i*)(cur + x)));
+        col8[(x >> 3)]     += _mm256_extract_epi16(v, 0);
+        col8[(x >> 3) + 1] += _mm256_extract_epi16(v, 4);
+        col8[(x >> 3) + 2] += _mm256_extract_epi16(v, 8);
+        col8[(x >> 3) + 3] += _mm256_extract_epi16(v, 12);
+    }
+    sad_row_scalar(prev, cur, x, width, col8);
+}
+#endif
+
+static void store_block(unsigned int sum, int block, int thresh, unsigned char* out)
+{
+    unsigned int mean = sum / (block * block);
+    if (mean > 255) { mean = 255; }
+    *out = ((int)mean > thresh) ? mean : 0;
+}
+
+void block_sad(const unsigned char* prev, const unsigned char* cur, int width, int height,
+               int block, unsigned char* out, int thresh)
+{
+    int row, x, i;
+    int blocks_wide = width / block;
+
+    if (block < 8) {
+        // Too narrow for psadbw to help.
+        unsigned int sum[blocks_wide];
+        for (row = 0; row < height; row++) {
+            if (!(row % block)) {
+                memset(sum, 0, sizeof(sum));
+            }
+            for (x = 0; x < blocks_wide * block; x++) {
+                sum[x / block] += abs(prev[x] - cur[x]);
+            }
+            if ((row % block) == block - 1) {
+                for (i = 0; i < blocks_wide; i++) {
+                    store_block(sum[i], block, thresh, out++);
+                }
+            }
+            prev += width;
+            cur += width;
+        }
+        return;
+    }
+
+    void (*sad_row)(const unsigned char*, const unsigned char*, int, unsigned int*);
+#ifdef __SSE2__
+    sad_row = __builtin_cpu_supports("avx2") ? sad_row_avx2 : sad_row_sse2;
+#else
+    sad_row = NULL;
+#endif
+
+    int cols8 = (width + 7) / 8;
+    unsigned int col8[cols8];
+    for (row = 0; row < height; row++) {
+        if (!(row % block)) {
+            memset(col8, 0, sizeof(col8));
+        }
+        if (sad_row) {
+            sad_row(prev, cur, width, col8);
+        } else {
+            sad_row_scalar(prev, cur, 0, width, col8);
+        }
+        if ((row % block) == block - 1) {
+            for (i = 0; i < blocks_wide; i++) {
+                unsigned int sum = 0;
+                for (x = 0; x < block / 8; x++) {
+                    sum += col8[i * (block / 8) + x];
+                }
+                store_block(sum, block, thresh, out++);
+            }
+        }
+        prev += width;
+        cur += width;
+    }
+}
+
+/* Cells [from, cells) of gauss_update(). */
+static void gauss_scalar(const float* x, float* mean, float* var, int cells, int from, float alpha, float k2,
+                         float min_var, unsigned char* out)
+{
+    int i, c;
+    for (i = from; i < cells; i++) {
+        float d[3], dist = 0;
+        for (c = 0; c < 3; c++) {
+            d[c] = x[c * cells + i] - mean[c * cells + i];
+            dist += d[c] * d[c];
+        }
+        dist = dist / 3;
+
+        if (dist > k2 * var[i]) {
+            int bright = (x[i] + x[cells + i] + x[2 * cells + i]) / 3;
+            out[i] = bright ? bright : 1;
+        } else {
+            out[i] = 0;
+        }
+
+        for (c = 0; c < 3; c++) {
+            mean[c * cells + i] += alpha * d[c];
+        }
+        var[i] += alpha * (dist - var[i]);
+        if (var[i] < min_var) { var[i] = min_var; }
+    }
+}
+
+#ifdef __SSE2__
+static int gauss_sse2(const float* x, float* mean, float* var, int cells, float alpha, float k2,
+                      float min_var, unsigned char* out)
+{
+    const __m128 a = _mm_set1_ps(alpha), k = _mm_set1_ps(k2), lo = _mm_set1_ps(min_var);
+    const __m128i one = _mm_set1_epi32(1);
+    int i, c;
+
+    for (i = 0; i + 4 <= cells; i += 4) {
+        __m128 d[3], dist = _mm_setzero_ps(), sum = _mm_setzero_ps();
+        for (c = 0; c < 3; c++) {
+            __m128 xc = _mm_loadu_ps(x + c * cells + i);
+            d[c] = _mm_sub_ps(xc, _mm_loadu_ps(mean + c * cells + i));
+            dist = _mm_add_ps(dist, _mm_mul_ps(d[c], d[c]));
+            sum = _mm_add_ps(sum, xc);
+        }
+        dist = _mm_div_ps(dist, _mm_set1_ps(3));
+        __m128 v = _mm_loadu_ps(var + i);
+
+        // Brightness of foreground cells, at least 1. 0 elsewhere.
+        __m128i fg = _mm_castps_si128(_mm_cmpgt_ps(dist, _mm_mul_ps(k, v)));
+        __m128i bright = _mm_cvttps_epi32(_mm_div_ps(sum, _mm_set1_ps(3)));
+        bright = _mm_or_si128(bright, _mm_and_si128(_mm_cmpeq_epi32(bright, _mm_setzero_si128()), one));
+        bright = _mm_and_si128(bright, fg);
+        bright = _mm_packus_epi16(_mm_packs_epi32(bright, bright), bright);
+        int packed = _mm_cvtsi128_si32(bright);
+        memcpy(out + i, &packed, 4);
+
+        for (c = 0; c < 3; c++) {
+            __m128 m = _mm_loadu_ps(mean + c * cells + i);
+            _mm_storeu_ps(mean + c * cells + i, _mm_add_ps(m, _mm_mul_ps(a, d[c])));
+        }
+        v = _mm_add_ps(v, _mm_mul_ps(a, _mm_sub_ps(dist, v)));
+        _mm_storeu_ps(var + i, _mm_max_ps(v, lo));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int gauss_avx2(const float* x, float* mean, float* var, int cells, float alpha, float k2,
+                      float min_var, unsigned char* out)
+{
+    const __m256 a = _mm256_set1_ps(alpha), k = _mm256_set1_ps(k2), lo = _mm256_set1_ps(min_var);
+    const __m256 three = _mm256_set1_ps(3);
+    const __m256i one = _mm256_set1_epi32(1);
+    int i, c;
+
+    for (i = 0; i + 8 <= cells; i += 8) {
+        __m256 d[3], dist = _mm256_setzero_ps(), sum = _mm256_setzero_ps();
+        for (c = 0; c < 3; c++) {
+            __m256 xc = _mm256_loadu_ps(x + c * cells + i);
+            d[c] = _mm256_sub_ps(xc, _mm256_loadu_ps(mean + c * cells + i));
+            dist = _mm256_add_ps(dist, _mm256_mul_ps(d[c], d[c]));
+            sum = _mm256_add_ps(sum, xc);
+        }
+        dist = _mm256_div_ps(dist, three);
+        __m256 v = _mm256_loadu_ps(var + i);
+
+        __m256i fg = _mm256_castps_si256(_mm256_cmp_ps(dist, _mm256_mul_ps(k, v), _CMP_GT_OQ));
+        __m256i bright = _mm256_cvttps_epi32(_mm256_div_ps(sum, three));
+        bright = _mm256_or_si256(bright, _mm256_and_si256(_mm256_cmpeq_epi32(bright, _mm256_setzero_si256()), one));
+        bright = _mm256_and_si256(bright, fg);
+        __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(bright), _mm256_extracti128_si256(bright, 1));
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(words, words));
+
+        for (c = 0; c < 3; c++) {
+            __m256 m = _mm256_loadu_ps(mean + c * cells + i);
+            _mm256_storeu_ps(mean + c * cells + i, _mm256_add_ps(m, _mm256_mul_ps(a, d[c])));
+        }
+        v = _mm256_add_ps(v, _mm256_mul_ps(a, _mm256_sub_ps(dist, v)));
+        _mm256_storeu_ps(var + i, _mm256_max_ps(v, lo));
+    }
+    return i;
+}
+#endif
+
+void gauss_update(const float* x, float* mean, float* var, int cells, float alpha, float k2, float min_var,
+                  unsigned char* out)
+{
+    int done = 0;
+#ifdef __SSE2__
+    if (__builtin_cpu_supports("avx2")) {
+        done = gauss_avx2(x, mean, var, cells, alpha, k2, min_var, out);
+    } else {
+        done = gauss_sse2(x, mean, var, cells, alpha, k2, min_var, out);
+    }
+#endif
+    gauss_scalar(x, mean, var, cells, done, alpha, k2, min_var, out);
+}
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hash64(const void* data, size_t length, uint64_t seed)
+{
+    const unsigned char* p = data;
+    const unsigned char* end = p + length;
+    uint64_t h;
+
+    if (length >= 32) {
+        // Four independent lanes keep the multipliers busy.
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+    h += length;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
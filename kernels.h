@@ -0,0 +1,86 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* yuyv_to_luma: Copy the Y samples out of a packed YUYV image.
+ * Arguments:
+ *      (unsigned char*)src: YUYV image. 2 bytes per pixel.
+ *      (unsigned char*)dst: Buffer to hold 1 byte per pixel.
+ *      (int)pixels:         Number of pixels in the image.
+ */
+void yuyv_to_luma(const unsigned char* src, unsigned char* dst, int pixels);
+
+/* nv12_to_rgb / yuv420_to_rgb / grey_to_rgb: Convert planar frames to RGB888.
+ * Same BT.601 formula as the YUYV converter, in 10 bit fixed point.
+ * Arguments:
+ *      (int)width:          Image width in pixels. Even.
+ *      (int)height:         Image height in pixels. Even.
+ *      (unsigned char*)y:   Y plane. height rows.
+ *      (int)y_stride:       Bytes from one row of y to the next. At least width.
+ *      (unsigned char*)uv:  Interleaved Cb Cr plane, one pair per 2x2 pixels. (NV12)
+ *      (unsigned char*)u:   Cb plane, one per 2x2 pixels. (YUV420)
+ *      (unsigned char*)v:   Cr plane, one per 2x2 pixels. (YUV420)
+ *      (int)uv_stride:      Bytes from one row of uv, or of u and v, to the next.
+ *      (unsigned char*)dst: Buffer to hold 3 bytes per pixel.
+ */
+void nv12_to_rgb(int width, int height, const unsigned char* y, int y_stride, const unsigned char* uv,
+                 int uv_stride, unsigned char* dst);
+void yuv420_to_rgb(int width, int height, const unsigned char* y, int y_stride, const unsigned char* u,
+                   const unsigned char* v, int uv_stride, unsigned char* dst);
+void grey_to_rgb(int width, int height, const unsigned char* y, int y_stride, unsigned char* dst);
+
+/* rgb_half: Halve an RGB888 image in both directions, averaging each 2x2 block.
+ * Arguments:
+ *      (unsigned char*)src: width * height pixels.
+ *      (int)width:          Source width in pixels.
+ *      (int)height:         Source height in pixels.
+ *      (unsigned char*)dst: Buffer for (width / 2) * (height / 2) pixels.
+ */
+void rgb_half(const unsigned char* src, int width, int height, unsigned char* dst);
+
+/* block_sad: Mean absolute difference between two luma images over square blocks.
+ * Uses psadbw (SSE2, or AVX2 where the CPU has it) for blocks 8 pixels wide or more.
+ * Arguments:
+ *      (unsigned char*)prev:  Previous luma image.
+ *      (unsigned char*)cur:   Current luma image.
+ *      (int)width:            Image width in pixels.
+ *      (int)height:           Image height in pixels.
+ *      (int)block:            Block size. Power of 2, 1 to 128.
+ *      (unsigned char*)out:   (width / block) * (height / block) results.
+ *                             Mean difference per pixel if above thresh, otherwise 0.
+ *      (int)thresh:           Mean difference per pixel that counts as movment.
+ */
+void block_sad(const unsigned char* prev, const unsigned char* cur, int width, int height,
+               int block, unsigned char* out, int thresh);
+
+/* gauss_update: Per cell Gaussian background model. Flags cells whose colour is
+ * more than sqrt(k2) standard deviations from the mean, then moves the mean and
+ * variance towards the new sample. Arrays are structure of arrays: channel c of
+ * cell i is at [c * cells + i].
+ * Arguments:
+ *      (float*)x:              Sampled RGB of each cell. 3 * cells.
+ *      (float*)mean:           Mean RGB of each cell. 3 * cells. Updated.
+ *      (float*)var:            Variance of each cell, over all 3 channels. cells. Updated.
+ *      (int)cells:             Number of cells.
+ *      (float)alpha:           Learning rate. 0 to 1.
+ *      (float)k2:              Threshold in variances, eg. 2.5 sigma == 6.25.
+ *      (float)min_var:         Floor for the variance so still scenes do not get too sensitive.
+ *      (unsigned char*)out:    Brightness of cells that differ, at least 1. 0 elsewhere.
+ */
+void gauss_update(const float* x, float* mean, float* var, int cells, float alpha, float k2, float min_var,
+                  unsigned char* out);
+
+/* hash64: XXH64 of a buffer. Not for security, just to tell frames apart.
+ * Arguments:
+ *      (void*)data:     Bytes to hash.
+ *      (size_t)length:  Number of bytes.
+ *      (uint64_t)seed:  Start value. Pass the hash of the previous plane to chain planes.
+ * Returns:
+ *      (uint64_t): The hash.
+ */
+uint64_t hash64(const void* data, size_t length, uint64_t seed);
+
+#endif  // KERNELS_H
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "mask.h"
+
+
+void mask_init(struct motion_mask* mask, int width, int height)
+{
+    mask->width = width;
+    mask->height = height;
+    mask->words_per_row = (width + 63) / 64;
+    mask->bits = calloc(mask->words_per_row * height, sizeof(uint64_t));
+    if (!mask->bits) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void mask_free(struct motion_mask* mask)
+{
+    free(mask->bits);
+    mask->bits = NULL;
+}
+
+/* Bits of the last word in a row that are real cells. */
+static uint64_t last_word_mask(const struct motion_mask* mask)
+{
+    int used = mask->width % 64;
+    return used ? (((uint64_t)1 << used) - 1) : ~(uint64_t)0;
+}
+
+void mask_from_cells(struct motion_mask* mask, const unsigned char* cells)
+{
+    int row, x;
+
+    memset(mask->bits, 0, sizeof(uint64_t) * mask->words_per_row * mask->height);
+    for (row = 0; row < mask->height; row++) {
+        uint64_t* words = mask->bits + row * mask->words_per_row;
+        x = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 16 <= mask->width; x += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(cells + x));
+            uint64_t set = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xFFFF;
+            words[x / 64] |= set << (x % 64);
+        }
+#endif
+        for (; x < mask->width; x++) {
+            if (cells[x]) {
+                words[x / 64] |= (uint64_t)1 << (x % 64);
+            }
+        }
+        cells += mask->width;
+    }
+}
+
+int mask_count(const struct motion_mask* mask)
+{
+    int i, count = 0;
+    for (i = 0; i < mask->words_per_row * mask->height; i++) {
+        count += __builtin_popcountll(mask->bits[i]);
+    }
+    return count;
+}
+
+/* Combine each cell of a row with its left and right neighbours.
+ * dilate: OR, otherwise AND. Padding bits are 0 so the row ends read as clear. */
+static void row_neighbours(const struct motion_mask* mask, const uint64_t* src, uint64_t* dst, int dilate)
+{
+    int i, n = mask->words_per_row;
+
+    for (i = 0; i < n; i++) {
+        uint64_t w = src[i];
+        uint64_t left = (w << 1) | (i > 0 ? src[i - 1] >> 63 : 0);
+        uint64_t right = (w >> 1) | (i < n - 1 ? src[i + 1] << 63 : 0);
+        dst[i] = dilate ? (w | left | right) : (w & left & right);
+    }
+    dst[n - 1] &= last_word_mask(mask);
+}
+
+static void morph(const struct motion_mask* src, struct motion_mask* dst, int dilate)
+{
+    int row, i, n = src->words_per_row;
+    uint64_t rows[3][n];            // Row results for row - 1, row and row + 1.
+
+    memset(rows[0], 0, sizeof(rows[0]));
+    row_neighbours(src, src->bits, rows[1], dilate);
+
+    for (row = 0; row < src->height; row++) {
+        if (row + 1 < src->height) {
+            row_neighbours(src, src->bits + (row + 1) * n, rows[2], dilate);
+        } else {
+            memset(rows[2], 0, sizeof(rows[2]));
+        }
+
+        uint64_t* out = dst->bits + row * n;
+        for (i = 0; i < n; i++) {
+            out[i] = dilate ? (rows[0][i] | rows[1][i] | rows[2][i]) : (rows[0][i] & rows[1][i] & rows[2][i]);
+        }
+
+        memcpy(rows[0], rows[1], sizeof(rows[0]));
+        memcpy(rows[1], rows[2], sizeof(rows[1]));
+    }
+}
+
+void mask_erode(const struct motion_mask* src, struct motion_mask* dst)
+{
+    morph(src, dst, 0);
+}
+
+void mask_dilate(const struct motion_mask* src, struct motion_mask* dst)
+{
+    morph(src, dst, 1);
+}
+
+static size_t put_varint(unsigned char* out, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+size_t mask_rle_max(const struct motion_mask* mask)
+{
+    // Worst case every cell is its own run, plus the header.
+    return (size_t)(mask->width * mask->height + 1) * 5 + 20;
+}
+
+size_t mask_rle(const struct motion_mask* mask, unsigned char* out)
+{
+    size_t size = 0;
+    uint64_t run = 0;
+    int cur = 0;
+    int row, i;
+
+    size += put_varint(out + size, mask->width);
+    size += put_varint(out + size, mask->height);
+
+    for (row = 0; row < mask->height; row++) {
+        const uint64_t* words = mask->bits + row * mask->words_per_row;
+        for (i = 0; i < mask->words_per_row; i++) {
+            int valid = (i == mask->words_per_row - 1 && mask->width % 64) ? mask->width % 64 : 64;
+            int pos = 0;
+            while (pos < valid) {
+                // Length of the run of cur bits from pos.
+                uint64_t flip = (cur ? ~words[i] : words[i]) >> pos;
+                int len = flip ? __builtin_ctzll(flip) : 64 - pos;
+                if (len > valid - pos) {
+                    len = valid - pos;
+                }
+                run += len;
+                pos += len;
+                if (pos < valid) {
+                    size += put_varint(out + size, run);
+                    run = 0;
+                    cur = !cur;
+                }
+            }
+        }
+    }
+    size += put_varint(out + size, run);
+    return size;
+}
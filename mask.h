@@ -0,0 +1,52 @@
+#ifndef MASK_H
+#define MASK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* One bit per detection cell. Bit (x % 64) of word (x / 64) in a row is cell x.
+ * Rows are padded to whole words and the padding bits are always 0. */
+struct motion_mask {
+    int         width;
+    int         height;
+    int         words_per_row;
+    uint64_t*   bits;
+};
+
+/* mask_init / mask_free: Allocate and release a mask of width x height cells. */
+void mask_init(struct motion_mask* mask, int width, int height);
+void mask_free(struct motion_mask* mask);
+
+/* mask_from_cells: Set a bit for every non zero byte of a cell buffer.
+ * Arguments:
+ *      (struct motion_mask*)mask:  Mask to fill.
+ *      (unsigned char*)cells:      width * height bytes, eg. movment_buf.
+ */
+void mask_from_cells(struct motion_mask* mask, const unsigned char* cells);
+
+/* mask_count: Number of set bits. */
+int mask_count(const struct motion_mask* mask);
+
+/* mask_erode / mask_dilate: 3x3 morphology. Cells outside the mask count as clear.
+ * Arguments:
+ *      (struct motion_mask*)src: Mask to read.
+ *      (struct motion_mask*)dst: Mask of the same size to write. Not src.
+ */
+void mask_erode(const struct motion_mask* src, struct motion_mask* dst);
+void mask_dilate(const struct motion_mask* src, struct motion_mask* dst);
+
+/* mask_rle: Serialise a mask as varints: width, height, then the lengths of
+ * alternating runs of clear and set cells in row order, starting with clear.
+ * Arguments:
+ *      (struct motion_mask*)mask: Mask to serialise.
+ *      (unsigned char*)out:       Buffer of at least mask_rle_max() bytes.
+ * Returns:
+ *      (size_t): Bytes written.
+ */
+size_t mask_rle(const struct motion_mask* mask, unsigned char* out);
+
+/* mask_rle_max: Largest output mask_rle() can produce for a mask. */
+size_t mask_rle_max(const struct motion_mask* mask);
+
+#endif  // MASK_H
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define BILLION  1000000000L
+
+
+long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * BILLION + ts.tv_nsec;
+}
+
+void stage_begin(struct stage* st)
+{
+    st->start_ns = now_ns();
+}
+
+void stage_end(struct stage* st)
+{
+    stage_add(st, now_ns() - st->start_ns);
+}
+
+void stage_add(struct stage* st, long long took)
+{
+    st->count++;
+    st->total_ns += took;
+    if (took > st->max_ns) {
+        st->max_ns = took;
+    }
+}
+
+long long stage_mean_ns(const struct stage* st)
+{
+    if (!st->count) {
+        return 0;
+    }
+    return st->total_ns / st->count;
+}
+
+int stage_over_budget(const struct stage* st)
+{
+    return st->budget_ns && stage_mean_ns(st) > st->budget_ns;
+}
+
+void stage_report(FILE* fp, const struct stage* st)
+{
+    fprintf(fp, "%-12s runs=%-8lu mean=%lldns max=%lldns", st->name, st->count, stage_mean_ns(st), st->max_ns);
+    if (st->budget_ns) {
+        fprintf(fp, " budget=%lldns%s", st->budget_ns, stage_over_budget(st) ? " OVER" : "");
+    }
+    fprintf(fp, "\n");
+}
@@ -0,0 +1,47 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+
+/* Timing for one stage of the frame pipeline. */
+struct stage {
+    const char*     name;
+    unsigned long   count;          // Number of times the stage has run.
+    long long       total_ns;
+    long long       max_ns;
+    long long       budget_ns;      // Mean ns per run allowed. 0 == no budget.
+    long long       start_ns;
+};
+
+/* now_ns: Monotonic clock in nanoseconds. */
+long long now_ns(void);
+
+/* stage_begin / stage_end: Time one run of a stage.
+ * Arguments:
+ *      (struct stage*)st: Stage being timed.
+ */
+void stage_begin(struct stage* st);
+void stage_end(struct stage* st);
+
+/* stage_add: Count one run of a stage that was timed by the caller.
+ * Arguments:
+ *      (struct stage*)st: Stage that ran.
+ *      (long long)took:   How long it took in ns.
+ */
+void stage_add(struct stage* st, long long took);
+
+/* stage_mean_ns: Mean time per run of a stage. 0 if it never ran. */
+long long stage_mean_ns(const struct stage* st);
+
+/* stage_over_budget: 1 if the stage has a budget and its mean is over it. Otherwise 0. */
+int stage_over_budget(const struct stage* st);
+
+/* stage_report: Print one line of timings for a stage.
+ * Arguments:
+ *      (FILE*)fp:         Where to print.
+ *      (struct stage*)st: Stage to print.
+ */
+void stage_report(FILE* fp, const struct stage* st);
+
+#endif  // METRICS_H
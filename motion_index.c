@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "motion_index.h"
+
+
+void motion_index_open(struct motion_index* idx, const char* filename)
+{
+    memset(idx, 0, sizeof(*idx));
+    idx->fp = fopen(filename, "ab");
+    if (!idx->fp) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n", filename, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (ftell(idx->fp) == 0) {
+        fwrite(MOTION_INDEX_MAGIC, 1, MOTION_INDEX_HEADER, idx->fp);
+        fflush(idx->fp);
+    }
+}
+
+static void write_pending(struct motion_index* idx)
+{
+    if (idx->have_pending) {
+        fwrite(&idx->pending, sizeof(idx->pending), 1, idx->fp);
+        fflush(idx->fp);
+        idx->have_pending = 0;
+    }
+}
+
+void motion_index_add(struct motion_index* idx, time_t time, int active_cells, int peak_blob, uint64_t offset)
+{
+    if (idx->have_pending && idx->pending.time != (uint32_t)time) {
+        write_pending(idx);
+    }
+    if (!idx->have_pending) {
+        memset(&idx->pending, 0, sizeof(idx->pending));
+        idx->pending.time = time;
+        idx->pending.offset = offset;
+        idx->have_pending = 1;
+    }
+    if (active_cells > 0xFFFF) { active_cells = 0xFFFF; }
+    if (peak_blob > 0xFFFF) { peak_blob = 0xFFFF; }
+    if (active_cells > idx->pending.active_cells) {
+        idx->pending.active_cells = active_cells;
+    }
+    if (peak_blob > idx->pending.peak_blob) {
+        idx->pending.peak_blob = peak_blob;
+    }
+}
+
+void motion_index_close(struct motion_index* idx)
+{
+    write_pending(idx);
+    fclose(idx->fp);
+    idx->fp = NULL;
+}
+
+const struct motion_entry* motion_index_map(const char* filename, size_t* count)
+{
+    struct stat st;
+    void* map;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n", filename, errno, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < MOTION_INDEX_HEADER) {
+        fprintf(stderr, "%s is no motion index\n", filename);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map '%s': %d, %s\n", filename, errno, strerror(errno));
+        return NULL;
+    }
+    if (memcmp(map, MOTION_INDEX_MAGIC, MOTION_INDEX_HEADER)) {
+        fprintf(stderr, "%s is no motion index\n", filename);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    // A writer may be part way through an entry.
+    *count = (st.st_size - MOTION_INDEX_HEADER) / sizeof(struct motion_entry);
+    return (const struct motion_entry*)((const char*)map + MOTION_INDEX_HEADER);
+}
+
+size_t motion_index_find(const struct motion_entry* entries, size_t count, time_t time)
+{
+    size_t low = 0, high = count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if ((time_t)entries[mid].time < time) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
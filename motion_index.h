@@ -0,0 +1,63 @@
+#ifndef MOTION_INDEX_H
+#define MOTION_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/* A motion index is a file starting with MOTION_INDEX_MAGIC followed by one
+ * struct motion_entry per second that frames were processed, oldest first.
+ * It is only ever appended to. */
+#define MOTION_INDEX_MAGIC "PEEPIDX1"
+#define MOTION_INDEX_HEADER 8
+
+struct motion_entry {
+    uint32_t    time;               // Seconds since the epoch.
+    uint16_t    active_cells;       // Most active cells in any frame of this second.
+    uint16_t    peak_blob;          // Largest blob in any frame of this second.
+    uint64_t    offset;             // Recording segment size at the start of this second.
+};
+
+struct motion_index {
+    FILE*               fp;
+    struct motion_entry pending;    // Second being filled in.
+    int                 have_pending;
+};
+
+/* motion_index_open: Open an index for appending, creating it if needed.
+ * Arguments:
+ *      (struct motion_index*)idx: Index to set up.
+ *      (char*)filename:           Name of the index file.
+ */
+void motion_index_open(struct motion_index* idx, const char* filename);
+
+/* motion_index_add: Record the results of one frame.
+ * A second is written to the file once a frame from a later second arrives.
+ * Arguments:
+ *      (struct motion_index*)idx: Index to add to.
+ *      (time_t)time:              Capture time of the frame.
+ *      (int)active_cells:         Cells that registered movment.
+ *      (int)peak_blob:            Cells in the largest blob.
+ *      (uint64_t)offset:          Current size of the recording segment.
+ */
+void motion_index_add(struct motion_index* idx, time_t time, int active_cells, int peak_blob, uint64_t offset);
+
+/* motion_index_close: Write the second being filled in and close the file. */
+void motion_index_close(struct motion_index* idx);
+
+/* motion_index_map: Memory map an index for reading.
+ * Arguments:
+ *      (char*)filename: Name of the index file.
+ *      (size_t*)count:  Set to the number of entries.
+ * Returns:
+ *      (struct motion_entry*): First entry, or NULL on failure.
+ */
+const struct motion_entry* motion_index_map(const char* filename, size_t* count);
+
+/* motion_index_find: Binary search for the first entry at or after a time.
+ * Returns:
+ *      (size_t): Index of that entry. count if there is none.
+ */
+size_t motion_index_find(const struct motion_entry* entries, size_t count, time_t time);
+
+#endif  // MOTION_INDEX_H
@@ -0,0 +1,79 @@
+/*
+ * List motion intervals from a peeper motion index.
+ *
+ * $ gcc ./peep_index.c ./motion_index.c -o peep_index -Wall
+ * $ ./peep_index peep_motion.idx 1700000000 1700086400 10
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "motion_index.h"
+
+
+int main(int argc, char **argv)
+{
+    const struct motion_entry* entries;
+    size_t count, i;
+    time_t from, to;
+    int threshold = 0;
+    int gap = 2;                    // Seconds of quiet that still count as one interval.
+
+    if (argc < 4 || argc > 6) {
+        fprintf(stderr, "Usage: %s index T1 T2 [threshold [gap]]\n"
+                        "List intervals between T1 and T2 (seconds since the epoch) with more than\n"
+                        "threshold active cells [%i]. Quiet spells of up to gap seconds are joined [%i].\n",
+                        argv[0], threshold, gap);
+        return EXIT_FAILURE;
+    }
+    from = atoll(argv[2]);
+    to = atoll(argv[3]);
+    if (argc > 4) {
+        threshold = atoi(argv[4]);
+    }
+    if (argc > 5) {
+        gap = atoi(argv[5]);
+    }
+
+    entries = motion_index_map(argv[1], &count);
+    if (!entries) {
+        return EXIT_FAILURE;
+    }
+
+    // start end seconds peak_cells peak_blob offset
+    int open = 0;
+    struct motion_entry first, peak;
+    time_t last = 0;
+    for (i = motion_index_find(entries, count, from); i <= count; i++) {
+        int done = (i == count) || (time_t)entries[i].time > to;
+        int active = !done && entries[i].active_cells > threshold;
+
+        if (open && (done || (time_t)entries[i].time - last > gap)) {
+            printf("%u %lu %lu %u %u %llu\n", first.time, (unsigned long)last,
+                   (unsigned long)(last - first.time + 1), peak.active_cells, peak.peak_blob,
+                   (unsigned long long)first.offset);
+            open = 0;
+        }
+        if (done) {
+            break;
+        }
+        if (!active) {
+            continue;
+        }
+        if (!open) {
+            first = entries[i];
+            peak = entries[i];
+            open = 1;
+        }
+        if (entries[i].active_cells > peak.active_cells) {
+            peak.active_cells = entries[i].active_cells;
+        }
+        if (entries[i].peak_blob > peak.peak_blob) {
+            peak.peak_blob = entries[i].peak_blob;
+        }
+        last = entries[i].time;
+    }
+
+    return EXIT_SUCCESS;
+}
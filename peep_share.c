@@ -0,0 +1,114 @@
+/*
+ * Consume frames shared by peeper --share. Maps the dmabuf of every buffer,
+ * prints one line per frame and releases it.
+ *
+ * $ gcc ./peep_share.c -o peep_share -Wall
+ * $ ./peep_share /tmp/peep.sock 100
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "share.h"
+
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    struct share_msg hello, msg;
+    int fds[SHARE_MAX_BUFFERS * SHARE_MAX_PLANES];
+    unsigned char* maps[SHARE_MAX_BUFFERS * SHARE_MAX_PLANES];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { &hello, sizeof(hello) };
+    struct msghdr mh;
+    struct cmsghdr* cmsg;
+    int frames = 0, limit = 0, hold_ms = 0;
+    unsigned int i, n_fds;
+
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: %s socket [frames [hold_ms]]\n"
+                        "Print frames shared by peeper --share. Stops after frames frames. 0 = never [%i].\n"
+                        "Holds each buffer for hold_ms before releasing it [%i].\n",
+                        argv[0], limit, hold_ms);
+        return EXIT_FAILURE;
+    }
+    if (argc > 2) {
+        limit = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        hold_ms = atoi(argv[3]);
+    }
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Cannot connect to '%s': %d, %s\n", argv[1], errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &mh, 0) != sizeof(hello) || hello.type != SHARE_HELLO ||
+            !(cmsg = CMSG_FIRSTHDR(&mh)) || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "No hello from '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (n_fds != hello.n_buffers * hello.n_planes) {
+        fprintf(stderr, "Expected %u buffers, got %u\n", hello.n_buffers * hello.n_planes, n_fds);
+        return EXIT_FAILURE;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n_fds);
+    for (i = 0; i < n_fds; i++) {
+        off_t size = lseek(fds[i], 0, SEEK_END);
+        maps[i] = mmap(NULL, size, PROT_READ, MAP_SHARED, fds[i], 0);
+        if (size <= 0 || maps[i] == MAP_FAILED) {
+            fprintf(stderr, "Cannot map buffer %u: %d, %s\n", i, errno, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    printf("%ux%u %.4s, %u buffers of %u planes\n", hello.width, hello.height, (char*)&hello.fourcc,
+           hello.n_buffers, hello.n_planes);
+
+    while (recv(sock, &msg, sizeof(msg), 0) == sizeof(msg)) {
+        if (msg.type != SHARE_FRAME || msg.index >= hello.n_buffers) {
+            fprintf(stderr, "Bad message\n");
+            return EXIT_FAILURE;
+        }
+
+        // Something cheap that still reads the frame.
+        const unsigned char* image = maps[msg.index * hello.n_planes];
+        unsigned long sum = 0;
+        for (i = 0; i < msg.bytesused; i += 64) {
+            sum += image[i];
+        }
+        printf("frame %u buffer %u %u bytes at %lli.%09lli sum %lu\n", msg.sequence, msg.index, msg.bytesused,
+               (long long)(msg.timestamp_ns / 1000000000), (long long)(msg.timestamp_ns % 1000000000), sum);
+
+        if (hold_ms) {
+            struct timespec hold = { hold_ms / 1000, (hold_ms % 1000) * 1000000L };
+            nanosleep(&hold, NULL);
+        }
+        msg.type = SHARE_RELEASE;
+        if (send(sock, &msg, sizeof(msg), 0) != sizeof(msg)) {
+            break;
+        }
+        if (limit && ++frames >= limit) {
+            break;
+        }
+    }
+    close(sock);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,101 @@
+#define _GNU_SOURCE             /* pthread_setaffinity_np() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "pool.h"
+
+
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   done_cond = PTHREAD_COND_INITIALIZER;
+static int              n_threads = 0;
+static unsigned long    generation = 0;         // Bumped for every pool_run().
+
+// The job being run. Protected by lock.
+static void             (*job_fn)(void*, int);
+static void*            job_arg;
+static int              job_count;
+static int              job_next;
+static int              job_done;
+
+/* Run tasks of the current job until none are left. Called with lock held. */
+static void run_tasks(void)
+{
+    while (job_next < job_count) {
+        int i = job_next++;
+        pthread_mutex_unlock(&lock);
+        job_fn(job_arg, i);
+        pthread_mutex_lock(&lock);
+        if (++job_done == job_count) {
+            pthread_cond_broadcast(&done_cond);
+        }
+    }
+}
+
+static void* worker(void* arg)
+{
+    unsigned long seen = 0;
+
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (generation == seen) {
+            pthread_cond_wait(&work_cond, &lock);
+        }
+        seen = generation;
+        run_tasks();
+    }
+    return NULL;
+}
+
+void pool_init(int threads, const int* cpus, int n_cpus)
+{
+    int i;
+
+    for (i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, NULL)) {
+            fprintf(stderr, "Could not start worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+        if (cpus && n_cpus) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % n_cpus], &set);
+            if (pthread_setaffinity_np(thread, sizeof(set), &set)) {
+                fprintf(stderr, "Could not pin worker thread to CPU %i\n", cpus[i % n_cpus]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        pthread_detach(thread);
+        n_threads++;
+    }
+}
+
+int pool_size(void)
+{
+    return n_threads + 1;
+}
+
+void pool_run(void (*fn)(void* arg, int i), void* arg, int count)
+{
+    pthread_mutex_lock(&lock);
+    job_fn = fn;
+    job_arg = arg;
+    job_count = count;
+    job_next = 0;
+    job_done = 0;
+    generation++;
+    pthread_cond_broadcast(&work_cond);
+
+    run_tasks();
+    while (job_done < job_count) {
+        pthread_cond_wait(&done_cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
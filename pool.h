@@ -0,0 +1,25 @@
+#ifndef POOL_H
+#define POOL_H
+
+
+/* pool_init: Start worker threads for pool_run().
+ * Arguments:
+ *      (int)threads:   Number of worker threads. The caller of pool_run() also works.
+ *      (int*)cpus:     CPUs to pin workers to, round robin. NULL == no pinning.
+ *      (int)n_cpus:    Number of entries in cpus.
+ */
+void pool_init(int threads, const int* cpus, int n_cpus);
+
+/* pool_size: Number of threads pool_run() spreads work over, including the caller. */
+int pool_size(void);
+
+/* pool_run: Call fn(arg, i) for every i in [0, count) on the pool and wait for all of them.
+ * Runs everything on the calling thread if pool_init() was never called.
+ * Arguments:
+ *      (void (*)(void*, int))fn: Task.
+ *      (void*)arg:               Passed to every task.
+ *      (int)count:               Number of tasks.
+ */
+void pool_run(void (*fn)(void* arg, int i), void* arg, int count);
+
+#endif  // POOL_H
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE             /* accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "share.h"
+
+
+struct share_client {
+    int             fd;                         // -1 == free slot.
+    unsigned char   held[SHARE_MAX_BUFFERS];    // Sent and not yet released.
+};
+
+static int                  listen_fd = -1;
+static char                 socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static struct share_msg     hello_msg;
+static int                  buffer_fds[SHARE_MAX_BUFFERS * SHARE_MAX_PLANES];
+static int                  refs[SHARE_MAX_BUFFERS];       // Consumers holding each buffer.
+static int                  n_out;                          // Buffers held by any consumer.
+static void                 (*requeue_buffer)(int index);
+static struct share_client  clients[SHARE_MAX_CLIENTS];
+
+
+void share_init(const char* path, const struct share_msg* hello, const int* fds, void (*requeue)(int index))
+{
+    struct sockaddr_un addr;
+    int i;
+
+    if (hello->n_buffers > SHARE_MAX_BUFFERS || hello->n_planes > SHARE_MAX_PLANES) {
+        fprintf(stderr, "Too many buffers to share: %u of %u planes\n", hello->n_buffers, hello->n_planes);
+        exit(EXIT_FAILURE);
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    hello_msg = *hello;
+    hello_msg.type = SHARE_HELLO;
+    memcpy(buffer_fds, fds, sizeof(int) * hello->n_buffers * hello->n_planes);
+    requeue_buffer = requeue;
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "socket error %d, %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(socket_path, path);
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, SHARE_MAX_CLIENTS) < 0) {
+        fprintf(stderr, "Cannot listen on '%s': %d, %s\n", path, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void release(int index)
+{
+    if (--refs[index] == 0) {
+        n_out--;
+        requeue_buffer(index);
+    }
+}
+
+/* Hang up on a consumer and give back everything it was holding. */
+static void drop_client(struct share_client* client)
+{
+    int i;
+
+    close(client->fd);
+    client->fd = -1;
+    for (i = 0; i < SHARE_MAX_BUFFERS; i++) {
+        if (client->held[i]) {
+            client->held[i] = 0;
+            release(i);
+        }
+    }
+}
+
+static void send_hello(struct share_client* client)
+{
+    int n_fds = hello_msg.n_buffers * hello_msg.n_planes;
+    char control[CMSG_SPACE(sizeof(buffer_fds))];
+    struct iovec iov = { &hello_msg, sizeof(hello_msg) };
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+    memcpy(CMSG_DATA(cmsg), buffer_fds, sizeof(int) * n_fds);
+
+    if (sendmsg(client->fd, &msg, MSG_NOSIGNAL) != sizeof(hello_msg)) {
+        fprintf(stderr, "share: hello failed: %d, %s\n", errno, strerror(errno));
+        drop_client(client);
+    }
+}
+
+static void accept_client(void)
+{
+    int i, fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+        return;
+    }
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0) {
+            memset(&clients[i], 0, sizeof(clients[i]));
+            clients[i].fd = fd;
+            send_hello(&clients[i]);
+            return;
+        }
+    }
+    fprintf(stderr, "share: more than %i consumers, hanging up\n", SHARE_MAX_CLIENTS);
+    close(fd);
+}
+
+/* Read every release a consumer has sent so far. */
+static void read_releases(struct share_client* client)
+{
+    struct share_msg msg;
+    ssize_t r;
+
+    while ((r = recv(client->fd, &msg, sizeof(msg), 0)) == sizeof(msg)) {
+        if (msg.type != SHARE_RELEASE || msg.index >= hello_msg.n_buffers || !client->held[msg.index]) {
+            fprintf(stderr, "share: bad message from consumer, hanging up\n");
+            drop_client(client);
+            return;
+        }
+        client->held[msg.index] = 0;
+        release(msg.index);
+    }
+    if (r >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        // Hung up, or sent something that is not a whole message.
+        drop_client(client);
+    }
+}
+
+void share_fds(fd_set* fds, int* max_fd)
+{
+    int i;
+
+    if (listen_fd < 0) {
+        return;
+    }
+    FD_SET(listen_fd, fds);
+    if (listen_fd > *max_fd) {
+        *max_fd = listen_fd;
+    }
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) {
+            FD_SET(clients[i].fd, fds);
+            if (clients[i].fd > *max_fd) {
+                *max_fd = clients[i].fd;
+            }
+        }
+    }
+}
+
+void share_service(fd_set* fds)
+{
+    int i;
+
+    if (listen_fd < 0) {
+        return;
+    }
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0 && FD_ISSET(clients[i].fd, fds)) {
+            read_releases(&clients[i]);
+        }
+    }
+    if (FD_ISSET(listen_fd, fds)) {
+        accept_client();
+    }
+}
+
+int share_frame(const struct share_msg* frame)
+{
+    int i;
+
+    // Leave the device at least 2 buffers whatever the consumers hold.
+    if (listen_fd < 0 || n_out + 2 >= (int)hello_msg.n_buffers) {
+        return 0;
+    }
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++) {
+        struct share_client* client = &clients[i];
+        if (client->fd < 0) {
+            continue;
+        }
+        if (send(client->fd, frame, sizeof(*frame), MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(*frame)) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                drop_client(client);
+            }
+            continue;
+        }
+        client->held[frame->index] = 1;
+        if (refs[frame->index]++ == 0) {
+            n_out++;
+        }
+    }
+    return refs[frame->index];
+}
+
+void share_close(void)
+{
+    int i;
+
+    if (listen_fd < 0) {
+        return;
+    }
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) {
+            close(clients[i].fd);
+            clients[i].fd = -1;
+        }
+    }
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path);
+}
@@ -0,0 +1,68 @@
+#ifndef SHARE_H
+#define SHARE_H
+
+#include <stdint.h>
+#include <sys/select.h>
+
+/* Capture buffers are shared with local consumers over a SOCK_SEQPACKET Unix
+ * socket. On connect a consumer gets one SHARE_HELLO message carrying a dmabuf
+ * fd per buffer plane (SCM_RIGHTS, buffer by buffer). After that it gets a
+ * SHARE_FRAME per captured frame naming the buffer, and must answer each with a
+ * SHARE_RELEASE for the same index once it is done reading. A buffer goes back
+ * to the device only when every consumer it was sent to has released it.
+ * Consumers that fall behind miss frames rather than stall capture. */
+#define SHARE_MAX_BUFFERS   32
+#define SHARE_MAX_PLANES    3
+#define SHARE_MAX_CLIENTS   8
+
+enum share_type {
+    SHARE_HELLO = 1,
+    SHARE_FRAME,
+    SHARE_RELEASE,
+};
+
+struct share_msg {
+    uint32_t    type;               // enum share_type.
+    uint32_t    index;              // Buffer. (SHARE_FRAME, SHARE_RELEASE)
+    uint32_t    bytesused;          // Bytes of image in the first plane. (SHARE_FRAME)
+    uint32_t    sequence;           // Frame counter from the driver. (SHARE_FRAME)
+    int64_t     timestamp_ns;       // Capture time. (SHARE_FRAME)
+    uint32_t    width;              // (SHARE_HELLO)
+    uint32_t    height;
+    uint32_t    fourcc;
+    uint32_t    n_buffers;
+    uint32_t    n_planes;           // fds in SHARE_HELLO == n_buffers * n_planes.
+};
+
+/* share_init: Start listening for consumers.
+ * Arguments:
+ *      (char*)path:                Socket to create. Replaced if it exists.
+ *      (struct share_msg*)hello:   SHARE_HELLO sent to each new consumer.
+ *      (int*)fds:                  dmabuf fds, n_planes per buffer. Kept open by the caller.
+ *      (void (*)(int))requeue:     Called with a buffer index once every consumer has released it.
+ */
+void share_init(const char* path, const struct share_msg* hello, const int* fds, void (*requeue)(int index));
+
+/* share_fds: Add the listening socket and every consumer to a select() set.
+ * Arguments:
+ *      (fd_set*)fds:   Set to add to.
+ *      (int*)max_fd:   Raised to the highest fd added.
+ */
+void share_fds(fd_set* fds, int* max_fd);
+
+/* share_service: Accept new consumers and handle releases for the fds that
+ * select() found ready. */
+void share_service(fd_set* fds);
+
+/* share_frame: Offer a captured buffer to every consumer that has room for it.
+ * Arguments:
+ *      (struct share_msg*)frame: SHARE_FRAME message.
+ * Returns:
+ *      (int): Consumers now holding the buffer. 0 == requeue it yourself.
+ */
+int share_frame(const struct share_msg* frame);
+
+/* share_close: Drop every consumer and remove the socket. */
+void share_close(void);
+
+#endif  // SHARE_H
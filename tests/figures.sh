@@ -0,0 +1,65 @@
+#!/bin/sh
+# Reproduce the figures quoted for detector and recording changes, on synthetic
+# clips from gen_clip.c. Sizes and counts are exact. Timings depend on the
+# machine, so compare them with each other rather than with the quoted ones.
+#
+# $ tests/figures.sh [older-peeper]
+#
+# An older peeper binary, if given, is timed on the same clips for comparison.
+
+case $1 in
+    /*) older=$1 ;;
+    ?*) older=$(pwd)/$1 ;;
+esac
+cd "$(dirname "$0")/.." || exit 1
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+gcc ./webcam.c ./jpeg.c ./kernels.c ./metrics.c ./pool.c ./motion_index.c ./mask.c ./share.c ./arena.c \
+    -ljpeg -lcrypto -lrt -lpthread -Wall -o "$work/peeper" || exit 1
+gcc ./tests/gen_clip.c -Wall -o "$work/gen_clip" || exit 1
+peeper=$work/peeper
+cd "$work" || exit 1
+
+# Print the detect stage line of a replay.
+detect()
+{
+    "$@" 2>&1 >/dev/null | grep '^detect'
+}
+
+./gen_clip square 320 240 30 > square.yuyv
+
+echo "Average detector, detect stage on a 320x240 clip:"
+detect "$peeper" --replay square.yuyv --size 320x240
+if [ -n "$older" ]; then
+    printf "older: "
+    detect "$older" --replay square.yuyv --size 320x240
+fi
+
+./gen_clip hd 1280 720 30 > hd.yuyv
+
+echo "Average and gauss detectors, detect stage by scale:"
+for clip in square.yuyv:320x240 hd.yuyv:1280x720; do
+    for scale in 16 4 2; do
+        for detector in average gauss; do
+            printf "%-8s scale %-2i %-7s " ${clip#*:} $scale $detector
+            detect "$peeper" --replay ${clip%:*} --size ${clip#*:} --scale $scale --detector $detector
+        done
+    done
+done
+
+echo "Recording of the 1280x720 clip, whole frames and --crop 10, in bytes:"
+"$peeper" --replay hd.yuyv --size 1280x720 --record full.mjpeg > /dev/null 2>&1
+"$peeper" --replay hd.yuyv --size 1280x720 --record crops.mjpeg --crop 10 2>&1 > /dev/null | grep '^crops='
+wc -c full.mjpeg crops.mjpeg | grep -v total
+
+./gen_clip led 160 120 3000 > led.yuyv
+
+echo "Events on a 300s clip with a blinking light, without and with --noisy 30:"
+"$peeper" --replay led.yuyv --size 160x120 --scale 8 2> /dev/null | grep -c '^event'
+"$peeper" --replay led.yuyv --size 160x120 --scale 8 --noisy 30 > noisy.out 2> /dev/null
+grep -c '^event' noisy.out
+grep '^noisy' noisy.out
+# The object passes for a second every 50s. By 260s the light has long been suppressed.
+printf "events at 260-261s: "
+grep -c '^event 260\.' noisy.out
@@ -0,0 +1,112 @@
+/*
+ * Write a synthetic YUYV clip for --replay to stdout.
+ *
+ * $ gcc ./tests/gen_clip.c -o gen_clip -Wall
+ * $ ./gen_clip square 128 96 16 > tests/square.yuyv
+ *
+ * square: a flat grey background with a coloured square moving right.
+ * hd:     a textured background with a coloured square moving right.
+ * led:    a textured background, one 8x8 spot blinking every other frame and,
+ *         for 10 frames in every 500, a dark object passing through.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* paint: Fill [x0, x1) x [y0, y1) of a YUYV frame with one colour. x0 and x1 are even. */
+static void paint(unsigned char* frame, int width, int x0, int x1, int y0, int y1,
+                  unsigned char y, unsigned char u, unsigned char v)
+{
+    int i, j;
+
+    for (j = y0; j < y1; j++) {
+        unsigned char* pixel = frame + (j * width + x0) * 2;
+        for (i = x0; i < x1; i += 2) {
+            *pixel++ = y;
+            *pixel++ = u;
+            *pixel++ = y;
+            *pixel++ = v;
+        }
+    }
+}
+
+/* texture: Fill a YUYV frame with a grey ramp, luma (x * dx + y * dy) % range + base. */
+static void texture(unsigned char* frame, int width, int height, int dx, int dy, int range, int base)
+{
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x += 2) {
+            unsigned char v = (x * dx + y * dy) % range + base;
+            paint(frame, width, x, x + 2, y, y + 1, v, 128, 128);
+        }
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    int width, height, frames, n;
+    unsigned char* frame;
+
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s square|hd|led width height frames > clip.yuyv\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    width = atoi(argv[2]);
+    height = atoi(argv[3]);
+    frames = atoi(argv[4]);
+    if (width < 128 || height < 96 || width % 2 || frames < 1) {
+        fprintf(stderr, "width must be even and at least 128, height at least 96\n");
+        return EXIT_FAILURE;
+    }
+
+    frame = malloc(width * height * 2);
+    if (!frame) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (n = 0; n < frames; n++) {
+        if (!strcmp(argv[1], "square")) {
+            // An eighth of the width wide, a quarter of the height high, a 64th of the width per frame.
+            int x = (width / 8 + n * width / 64) & ~1;
+            paint(frame, width, 0, width, 0, height, 80, 128, 128);
+            if (x < width) {
+                int x1 = x + width / 8 < width ? x + width / 8 : width;
+                paint(frame, width, x, x1, height / 4, height / 2, 220, 60, 200);
+            }
+        } else if (!strcmp(argv[1], "hd")) {
+            // 80x80 on a 1280x720 frame, moving 20 pixels a frame.
+            int size = width / 16 & ~1;
+            int x = (width * 5 / 64 + n * width / 64) & ~1;
+            int y = height * 5 / 12;
+            texture(frame, width, height, 7, 3, 200, 20);
+            if (x < width && y + size <= height) {
+                int x1 = x + size < width ? x + size : width;
+                paint(frame, width, x, x1, y, y + size, 240, 90, 200);
+            }
+        } else if (!strcmp(argv[1], "led")) {
+            texture(frame, width, height, 3, 2, 150, 40);
+            if (n % 2) {
+                paint(frame, width, 16, 24, 16, 24, 200, 100, 240);
+            }
+            if (n % 500 >= 100 && n % 500 < 110) {
+                int x = 60 + (n % 500 - 100) * 4;
+                paint(frame, width, x, x + 16, 60, 90, 60, 220, 100);
+            }
+        } else {
+            fprintf(stderr, "Unknown scene '%s'\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        if (fwrite(frame, width * height * 2, 1, stdout) != 1) {
+            perror("stdout");
+            return EXIT_FAILURE;
+        }
+    }
+
+    free(frame);
+    return EXIT_SUCCESS;
+}
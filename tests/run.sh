@@ -0,0 +1,62 @@
+#!/bin/sh
+# Build peeper, replay tests/square.yuyv through each detector and compare the
+# detector output and event lines with the checked in golden files.
+# Exits non-zero on any difference, a missing golden file or a stage over budget.
+#
+# $ tests/run.sh            check
+# $ tests/run.sh record     rewrite the golden files after an intended change
+#
+# square.yuyv is "gen_clip square 128 96 16" (see gen_clip.c).
+
+cd "$(dirname "$0")/.." || exit 1
+tests=$(pwd)/tests
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+gcc ./webcam.c ./jpeg.c ./kernels.c ./metrics.c ./pool.c ./motion_index.c ./mask.c ./share.c ./arena.c \
+    -ljpeg -lcrypto -lrt -lpthread -Wall -o "$work/peeper" || exit 1
+mkdir "$work/cwd"
+
+failed=0
+for detector in average sad gauss; do
+    golden=$tests/square.$detector.golden
+    events=$tests/square.$detector.events
+    case $detector in
+        average) opts="--scale 4 --despeckle" ;;
+        sad) opts="--scale 8" ;;
+        gauss) opts="--scale 8 --noisy 30" ;;
+    esac
+
+    if [ "$1" = record ]; then
+        rm -f "$golden"
+    elif [ ! -f "$golden" ] || [ ! -f "$events" ]; then
+        echo "$detector: missing $golden or $events, run $0 record" >&2
+        failed=1
+        continue
+    fi
+
+    # Replay in an empty directory so anything it writes shows up.
+    (cd "$work/cwd" && "$work/peeper" --replay "$tests/square.yuyv" --size 128x96 --detector $detector $opts \
+        --golden "$golden" --budget detect=2000000 > "$work/events" 2> "$work/log")
+    status=$?
+    if [ "$1" = record ]; then
+        cp "$work/events" "$events"
+    fi
+
+    if [ $status -ne 0 ]; then
+        cat "$work/log" >&2
+        echo "$detector: FAILED" >&2
+        failed=1
+    elif ! cmp -s "$work/events" "$events"; then
+        diff "$events" "$work/events" >&2
+        echo "$detector: events differ from $events" >&2
+        failed=1
+    elif [ -n "$(ls -A "$work/cwd")" ]; then
+        echo "$detector: replay wrote $(ls -A "$work/cwd")" >&2
+        failed=1
+    else
+        echo "$detector: ok"
+    fi
+    rm -rf "$work/cwd"/*
+done
+exit $failed
@@ -7,16 +7,21 @@
  * $ gcc ./peeper.c ./jpeg.c -ljpeg -lrt -Wall
  */
 
+#define _GNU_SOURCE             /* sched_setaffinity() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <dirent.h>
+#include <sched.h>
 
 #include <getopt.h>             /* getopt_long() */
 
 #include <fcntl.h>              /* low-level i/o */
 #include <unistd.h>
 #include <errno.h>
+#include <stddef.h>             /* offsetof() */
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -24,13 +29,28 @@
 #include <sys/ioctl.h>
 #include <time.h>
 
+#include "arena.h"
 #include "jpeg.h"
+#include "kernels.h"
+#include "mask.h"
+#include "metrics.h"
+#include "motion_index.h"
+#include "pool.h"
+#include "share.h"
 
 #include <linux/videodev2.h>
+#include <openssl/evp.h>
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 #define BILLION  1000000000L
 
+#define GAUSS_ALPHA     0.05    // Learning rate of the Gaussian model.
+#define GAUSS_START_VAR 100     // Variance of every cell before anything has been learnt.
+#define GAUSS_MIN_VAR   4       // Noise floor. Stops still scenes getting over sensitive.
+
+#define HEAT_SECONDS    120     // Time constant of the per cell activity average. (noisy_percent)
+#define HEATMAP_SECONDS 10      // Between writes of peep_heatmap.jpeg. (noisy_percent)
+
 #define R 0
 #define G 1
 #define B 2
@@ -41,9 +61,35 @@ enum io_method {
         IO_METHOD_USERPTR,
 };
 
+enum detector {
+        DETECTOR_AVERAGE,       // Difference from a slow moving average background.
+        DETECTOR_SAD,           // Difference from the previous frame.
+        DETECTOR_GAUSS,         // Distance from a per cell mean, in standard deviations.
+};
+
+enum duty_mode {
+        MODE_ACTIVE,            // Full rate, full pipeline.
+        MODE_IDLE,              // Low rate, coarse luma only detection. No conversion or output.
+};
+
 struct buffer {
-        void   *start;
+        void   *start;                                  // Same as planes[0].
         size_t  length;
+        void   *planes[VIDEO_MAX_PLANES];               // One per memory plane.
+        size_t  plane_length[VIDEO_MAX_PLANES];
+        int     dmabuf[VIDEO_MAX_PLANES];               // Exported planes. (share_name)
+};
+
+/* A pixel format we can capture, and the kernels for it. */
+struct pix_format {
+        unsigned int    fourcc;
+        int             mem_planes;                     // Separate buffers per frame in the multi-planar API.
+        int             bits_per_pixel;                 // All planes together.
+        int             line_bytes;                     // Bytes per pixel in a line of the first plane.
+        int             luma_plane;                     // First plane is a Y plane.
+        int             planes;                         // Y, UV or Y, U, V planes, however they are stored.
+        void            (*to_rgb)(int width, int height, unsigned char** planes, const unsigned int* strides,
+                                  unsigned char* dst);
 };
 
 struct screen_buf {
@@ -56,28 +102,194 @@ struct screen_buf {
 
 static struct screen_buf last_frame;
 
+#define MAX_RENDITIONS  8
+#define PYRAMID_LEVELS  8       // Halvings of the frame. 1/1 to 1/128.
+
+/* A Jpeg written from one level of the downscale pyramid. */
+struct rendition {
+        int             level;                          // Halvings of the frame. 0 == full size.
+        double          interval;                       // Min seconds between encodes. 0 == every frame.
+        int             quality;
+        int             motion_only;                    // Only frames with movment.
+        long long       last_ns;                        // When it was last encoded. -1 == never.
+        char            filename[32];
+};
+
+#define MAX_CROPS       16
+#define CROP_ALIGN      16      // MCU of the 4:2:0 Jpegs libjpeg makes from RGB, so crops share the frame's blocks.
+#define CONTEXT_QUALITY 30      // Of the full frames recorded now and then alongside crops.
+
+/* A rectangle of the frame around movment, in capture pixels. (crop_mode) */
+struct crop {
+        int             x, y, width, height;
+        unsigned char*  mem;                            // Compressed crop.
+        unsigned long   size;
+};
+
+#define CACHE_MAGIC     "peepdc2"
+
+/* What init_device() settled on, saved to --cache so a restart can skip probing.
+ * Everything up to detect_fourcc is the key: if any of it differs, probe again. */
+struct device_cache {
+        char            magic[8];
+        unsigned char   card[32];                       // From VIDIOC_QUERYCAP.
+        unsigned char   bus_info[32];
+        dev_t           rdev;
+        struct timespec node_ctime;                     // New whenever the node is made again, eg. on replug.
+        unsigned int    buf_type;
+        unsigned int    detect_width;                   // The flags that pick the mode.
+        unsigned int    detect_height;
+        unsigned int    detect_fps;
+        unsigned int    detector;                       // The average detector cannot use GREY.
+        unsigned int    detect_fourcc;                  // detect_mode and full_mode.
+        unsigned int    detect_mode_width;
+        unsigned int    detect_mode_height;
+        unsigned int    full_fourcc;
+        unsigned int    full_mode_width;
+        unsigned int    full_mode_height;
+};
+
 static char            *dev_name;
 static enum io_method   io = IO_METHOD_MMAP;
 static int              fd = -1;
+static enum v4l2_buf_type buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 struct buffer          *buffers;
 static unsigned int     n_buffers;
+static unsigned int     n_planes = 1;
+static const struct pix_format *pix_format;     // Picked in init_io().
+static unsigned char*   frame_planes[3];        // Y, U and V (or packed, UV) of last_frame.
+static unsigned int     plane_stride[3];        // Bytes from one row of each of frame_planes to the next.
+static size_t           plane_offset[3];        // Of each of frame_planes from the start of a single plane buffer.
+static size_t           mem_plane_bytes[3];     // Image data in each memory plane, padding included.
+static size_t           frame_plane_bytes[3];   // The same for last_frame, less any data_offset.
 
 // Command line flags
 static int              force_format;
+static enum detector    detector = DETECTOR_AVERAGE;
 static int              scale = 16;
 static float            ave_thresh = 0.1;
 static int              bright_thresh = 20;
 static int              col_thresh = 10;
+static float            sigma = 2.5;            // Standard deviations from the mean that count as movment. (DETECTOR_GAUSS)
+static unsigned int     detect_width = 0;       // Smallest capture size that still suits detection.
+static unsigned int     detect_height = 0;
+static unsigned int     detect_fps = 10;
+static int              snapshot_interval = 0;  // Min seconds between full resolution snapshots. 0 == off.
+static int              stats_interval = 0;     // Seconds between printing stage timings. 0 == off.
+static char            *replay_name;            // Raw YUYV file to run instead of a device.
+static char            *golden_name;            // Expected detector output for replay_name.
+static char            *share_name;             // Unix socket to share capture buffers on.
+static int              bench_mode;             // Time the detection kernels and exit.
+static char            *batch_name;             // Directory of Jpegs to run instead of a device.
+static int              capture_cpu = -1;       // CPU to pin the capture thread to. -1 == any.
+static int              worker_cpus[CPU_SETSIZE]; // CPUs to pin worker threads to.
+static int              n_worker_cpus = 0;
+static int              workers = 0;            // Worker threads besides the capture thread.
+static int              jpeg_quality = 70;
+static int              jpeg_slices = 1;        // Slices each Jpeg is split into for parallel encoding.
+static char            *index_name;             // Per second motion index to append to.
+static char            *record_name;            // Segment to append Jpegs of frames with movment to.
+static int              crop_mode;              // Record crops around the movment instead of whole frames.
+static int              context_interval = 60;  // Min seconds between low quality full frames. (crop_mode)
+static int              rt_priority = 0;        // SCHED_FIFO priority of the capture thread. 0 == off.
+static int              lock_memory;            // mlockall() and prefault buffers.
+static int              huge_pages;             // Back the arenas with 2MB pages.
+static int              idle_after = 0;         // Seconds without movment before going idle. 0 == never.
+static int              idle_fps = 2;           // Frame rate while idle.
+static int              despeckle;              // Open the motion mask to drop lone cells.
+static int              export_mask;            // Write the motion mask to peep_movment.rle.
+static int              gain_regions = 0;       // Regions per side for lighting compensation. 0 == off.
+static int              flood_percent = 0;      // Movment over more of the frame than this is a lighting change. 0 == off.
+static int              noisy_percent = 0;      // Cells moving more of the time than this stop triggering. 0 == off.
+static int              stale_after = 0;        // Identical frames in a row before the feed counts as stale. 0 == never.
+static int              audit_sha256;           // Add a SHA-256 of the frame to event lines.
+static char            *cache_name;             // Where to keep what init_device() found, to skip probing next time.
 
 static int 			    capture_width = 0;
 static int			    capture_height = 0;
 static int              first_run = 1;
+static long long        startup_ns;             // When main() started.
+
+// Modes picked by negotiate_format().
+static struct mode {
+        unsigned int width;
+        unsigned int height;
+        const struct pix_format *format;
+} detect_mode, full_mode;                       // Cheapest that suits detection, and largest.
+
+static long long        last_frame_ns;          // When last_frame was dequeued.
+
+// Adaptive duty cycle.
+static enum duty_mode   duty_mode = MODE_ACTIVE;
+static long long        mode_ns[2];             // Time spent in each mode.
+static long long        mode_since_ns;          // When the current mode started.
+static long long        last_movment_ns;        // When movment was last seen.
+static int              idle_scale;             // Block size used while idle.
 
 // Data containers
 //static unsigned char*   last_buf;               // Last sucessfull read from webcam.
 static float*           average_buf;            // Average monochrome image over last several frames.
 static unsigned char*   average_char_buf;       // unsigned char buffer with average_buf data in it.
 static unsigned char*   movment_buf;            // Diff between rgb_buf and average_buf.
+static float*           gauss_x;                // Sampled R, G and B of each cell. (DETECTOR_GAUSS)
+static float*           gauss_mean;             // Mean R, G and B of each cell. (DETECTOR_GAUSS)
+static float*           gauss_var;              // Variance of each cell. (DETECTOR_GAUSS)
+static unsigned char*   luma_buf;               // Y plane of the current frame. (DETECTOR_SAD)
+static unsigned char*   last_luma_buf;          // Y plane of the previous frame. (DETECTOR_SAD)
+static unsigned char*   idle_luma_buf;          // Y plane of the current frame. (MODE_IDLE)
+static unsigned char*   idle_last_luma_buf;     // Y plane of the previous idle frame. (MODE_IDLE)
+static unsigned char*   idle_movment_buf;       // block_sad() output at idle_scale. (MODE_IDLE)
+static int*             blob_stack;             // Cells waiting to be visited by find_blobs().
+static struct motion_mask blob_todo;            // Cells of motion_mask not yet visited by find_blobs().
+static float*           region_gain;            // Background over frame brightness per region. (gain_regions)
+static double*          region_sums;            // Frame and background brightness per region. (gain_regions)
+static void           (*update_movment)(unsigned char*); // movment_kernels[] entry for scale. Set by init_buf().
+static struct motion_mask motion_mask;          // Cells that moved: movment_buf less despeckled and noisy cells.
+static struct motion_mask scratch_mask;         // Erode output while despeckling.
+static unsigned char*   rle_buf;                // mask_rle() output.
+static float*           heat;                   // Decayed fraction of the time each cell moved. (noisy_percent)
+static unsigned char*   heat_rgb;               // heat as an image for peep_heatmap.jpeg. (noisy_percent)
+static struct motion_mask noisy_mask;           // Cells too busy to trigger. (noisy_percent)
+static int              noisy_cells;            // Bits set in noisy_mask.
+
+// Per frame results.
+static int              active_cells;           // Cells in movment_buf that registered movment.
+static int              blob_count;             // Connected groups of active cells.
+static int              peak_blob;              // Cells in the largest group.
+
+// Frame fingerprints.
+static uint64_t         frame_hash;             // hash64() of last_frame.
+static int              repeats;                // Frames in a row identical to the one before.
+static long long        duplicate_frames;       // Frames skipped for being identical to the one before.
+
+// Memory. Mapped from the capture thread, after it is pinned.
+static struct arena     capture_arena = { .name = "capture" };      // Frame buffers for --read and --userp.
+static struct arena     work_arena = { .name = "work" };            // RGB frames and detection buffers.
+
+// Outputs.
+static struct rendition renditions[MAX_RENDITIONS];
+static int              n_renditions;
+static int              pyramid_depth;          // Deepest level any rendition needs.
+static struct screen_buf pyramid[PYRAMID_LEVELS]; // Halved frames. [0] is unused, level 0 is the RGB frame.
+static struct crop      crops[MAX_CROPS];      // Around the blobs of this frame. Set by find_blobs().
+static int              n_crops;
+static struct motion_index motion_index;
+static FILE*            record_fp;
+static uint64_t         record_size;            // Bytes in the recording segment.
+static long long        crop_count;             // Crops recorded. (crop_mode)
+static unsigned long long crop_pixels;          // Pixels in those crops.
+static unsigned long long frame_pixels;         // Pixels in the frames they were cut from.
+static unsigned long long crop_bytes;           // Jpeg bytes of the crops.
+static unsigned long long context_bytes;        // Jpeg bytes of the context frames.
+
+// Pipeline timings.
+static struct stage     convert_stage = { .name = "convert" };
+static struct stage     detect_stage = { .name = "detect" };
+static struct stage     encode_stage = { .name = "encode" };
+static struct stage     snapshot_stage = { .name = "snapshot" };        // Encode of a full resolution snapshot.
+static struct stage     latency_stage = { .name = "dq_to_detect" };    // Dequeue to end of detection.
+static struct stage*    stages[] = { &convert_stage, &detect_stage, &encode_stage, &snapshot_stage, &latency_stage };
+#define NUM_STAGES (sizeof(stages) / sizeof(stages[0]))
 //static unsigned char*   rgb_buf;                // last_buf converted to RGB colours.
 
 
@@ -87,24 +299,24 @@ static unsigned char*   movment_buf;            // Diff between rgb_buf and aver
 
   \param width width of image
   \param height height of image
+  \param stride bytes from one line of src to the next
   \param src source
   \param dst destination
 */
-static void YUV422toRGB888(int width, int height, unsigned char *src, unsigned char *dst)
+static void YUV422toRGB888(int width, int height, int stride, unsigned char *src, unsigned char *dst)
 {
   int line, column;
   unsigned char *py, *pu, *pv;
   unsigned char *tmp = dst;
 
-  /* In this format each four bytes is two pixels. Each four bytes is two Y's, a Cb and a Cr. 
-     Each Y goes to one of the pixels, and the Cb and Cr belong to both pixels. */
-  py = src;
-  pu = src + 1;
-  pv = src + 3;
-
   #define CLIP(x) ( (x)>=0xFF ? 0xFF : ( (x) <= 0x00 ? 0x00 : (x) ) )
 
   for (line = 0; line < height; ++line) {
+    /* In this format each four bytes is two pixels. Each four bytes is two Y's, a Cb and a Cr. 
+       Each Y goes to one of the pixels, and the Cb and Cr belong to both pixels. */
+    py = src + line * stride;
+    pu = py + 1;
+    pv = py + 3;
     for (column = 0; column < width; ++column) {
       *tmp++ = CLIP((double)*py + 1.402*((double)*pv-128.0));
       *tmp++ = CLIP((double)*py - 0.344*((double)*pu-128.0) - 0.714*((double)*pv-128.0));
@@ -136,18 +348,118 @@ static void float_buf_to_char_buf(float* float_buf, unsigned char* char_buf, int
     }
 }
 
+static void yuyv_frame_to_rgb(int width, int height, unsigned char** planes, const unsigned int* strides,
+                              unsigned char* dst)
+{
+    YUV422toRGB888(width, height, strides[0], planes[0], dst);
+}
+
+static void nv12_frame_to_rgb(int width, int height, unsigned char** planes, const unsigned int* strides,
+                              unsigned char* dst)
+{
+    nv12_to_rgb(width, height, planes[0], strides[0], planes[1], strides[1], dst);
+}
+
+static void yuv420_frame_to_rgb(int width, int height, unsigned char** planes, const unsigned int* strides,
+                                unsigned char* dst)
+{
+    yuv420_to_rgb(width, height, planes[0], strides[0], planes[1], planes[2], strides[1], dst);
+}
+
+static void grey_frame_to_rgb(int width, int height, unsigned char** planes, const unsigned int* strides,
+                              unsigned char* dst)
+{
+    grey_to_rgb(width, height, planes[0], strides[0], dst);
+}
+
+static const struct pix_format pix_formats[] = {
+        { V4L2_PIX_FMT_YUYV,    1, 16, 2, 0, 1, yuyv_frame_to_rgb },
+        { V4L2_PIX_FMT_NV12,    1, 12, 1, 1, 2, nv12_frame_to_rgb },
+        { V4L2_PIX_FMT_NV12M,   2, 12, 1, 1, 2, nv12_frame_to_rgb },
+        { V4L2_PIX_FMT_YUV420,  1, 12, 1, 1, 3, yuv420_frame_to_rgb },
+        { V4L2_PIX_FMT_YUV420M, 3, 12, 1, 1, 3, yuv420_frame_to_rgb },
+        { V4L2_PIX_FMT_GREY,    1,  8, 1, 1, 1, grey_frame_to_rgb },
+};
+
+static const struct pix_format* find_pix_format(unsigned int fourcc)
+{
+    unsigned int i;
+    for (i = 0; i < sizeof(pix_formats) / sizeof(pix_formats[0]); i++) {
+        if (pix_formats[i].fourcc == fourcc) {
+            return &pix_formats[i];
+        }
+    }
+    return NULL;
+}
+
 static void errno_exit(const char *s)
 {
         fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
         exit(EXIT_FAILURE);
 }
 
-static void process_image(const void *p, int size)
+/* process_image: Make a dequeued buffer last_frame.
+ * Arguments:
+ *      (void**)planes:              Start of each memory plane of the buffer.
+ *      (struct v4l2_plane*)mp:      As dequeued, for the data_offset of each plane. NULL unless
+ *                                   the multi-planar API is in use.
+ *      (int)size:                   Bytes used.
+ */
+static void process_image(void **planes, const struct v4l2_plane* mp, int size)
 {   
+    int i;
+
     // Save pointer to last sucessfully filled v4l2 buffer.
-    last_frame.start = (void*)p;
+    last_frame_ns = now_ns();
+    last_frame.start = planes[0];
     last_frame.width = capture_width;
     last_frame.height = capture_height;
+
+    if (pix_format->mem_planes > 1) {
+        for (i = 0; i < pix_format->mem_planes; i++) {
+            unsigned int offset = mp ? mp[i].data_offset : 0;
+            frame_planes[i] = (unsigned char*)planes[i] + offset;
+            frame_plane_bytes[i] = mem_plane_bytes[i] - offset;
+        }
+    } else {
+        frame_plane_bytes[0] = mem_plane_bytes[0];
+        // Planes follow each other in the one buffer, each after the padded height of the one before.
+        for (i = 0; i < pix_format->planes; i++) {
+            frame_planes[i] = (unsigned char*)planes[0] + plane_offset[i];
+        }
+    }
+}
+
+/* set_plane_layout: Set plane_stride[], plane_offset[] and mem_plane_bytes[] for
+ * pix_format at capture_width x capture_height.
+ * Arguments:
+ *      (unsigned int*)bytesperline: Of each memory plane, as the format was set.
+ *      (unsigned int*)sizeimage:    Of each memory plane, as the format was set.
+ */
+static void set_plane_layout(const unsigned int* bytesperline, const unsigned int* sizeimage)
+{
+    int i;
+
+    for (i = 0; i < pix_format->mem_planes; i++) {
+        plane_stride[i] = bytesperline[i];
+        mem_plane_bytes[i] = sizeimage[i];
+    }
+    plane_offset[0] = 0;
+    if (pix_format->mem_planes == 1 && pix_format->planes > 1) {
+        // Some ISPs pad the Y plane to an aligned height, which only shows in sizeimage.
+        unsigned int padded_height = (unsigned long)sizeimage[0] * 8 /
+                                     ((unsigned long)bytesperline[0] * pix_format->bits_per_pixel);
+        if (padded_height < (unsigned int)capture_height) {
+            padded_height = capture_height;
+        }
+        padded_height = (padded_height + 1) & ~1;
+        // NV12 has one Cb Cr row per two Y rows, as wide. YUV420 has a Cb and a Cr half as wide.
+        for (i = 1; i < pix_format->planes; i++) {
+            plane_stride[i] = bytesperline[0] / (pix_format->planes - 1);
+            plane_offset[i] = plane_offset[i - 1] + (size_t)plane_stride[i - 1] * (i == 1 ? padded_height :
+                                                                                     padded_height / 2);
+        }
+    }
 }
 
 static int xioctl(int fh, int request, void *arg)
@@ -161,22 +473,235 @@ static int xioctl(int fh, int request, void *arg)
         return r;
 }
 
+/* estimate_gain: Brightness of the background over the current frame for each
+ * of the gain_regions x gain_regions regions, from the pixels update_movment()
+ * samples. Cells that moved last frame are left out so whatever is moving
+ * does not set the gain. Fills region_gain.
+ */
+static void estimate_gain(const unsigned char* _rgb_source_buf)
+{
+    int cells_wide = capture_width / scale;
+    int cells_high = capture_height / scale;
+    int regions = gain_regions * gain_regions;
+    int row, colum, i;
+    const float *tmp_average = average_buf;
+    const unsigned char *tmp_movment = movment_buf;
+
+    memset(region_sums, 0, sizeof(double) * 2 * regions);
+    for (row = 0; row < cells_high; row++) {
+        const unsigned char *pixel = _rgb_source_buf + row * scale * capture_width * 3;
+        double *sums = region_sums + 2 * (row * gain_regions / cells_high) * gain_regions;
+        for (colum = 0; colum < cells_wide; colum++) {
+            if (!*tmp_movment) {
+                double *sum = sums + 2 * (colum * gain_regions / cells_wide);
+                sum[0] += pixel[R] + pixel[G] + pixel[B];
+                sum[1] += tmp_average[R] + tmp_average[G] + tmp_average[B];
+            }
+            pixel += scale * 3;
+            tmp_average += 3;
+            tmp_movment++;
+        }
+    }
+
+    for (i = 0; i < regions; i++) {
+        float gain = (region_sums[2 * i] > 0) ? region_sums[2 * i + 1] / region_sums[2 * i] : 1.0;
+        // Past this the region is too dark or blown out to say anything useful.
+        if (gain < 0.25) { gain = 0.25; }
+        if (gain > 4.0) { gain = 4.0; }
+        region_gain[i] = gain;
+    }
+}
+
+/* movment_cell: Update the background of one cell from its sampled pixel and
+ * set its movment. Shared by movment_kernel() and update_movment_modulo().
+ */
+static inline __attribute__((always_inline)) void movment_cell(const unsigned char* pixel, float* tmp_average,
+                                                               unsigned char* tmp_movment, float gain)
+{
+    if (first_run) {
+        // Copy the first frame into the average buffer.
+        tmp_average[R] = pixel[R];
+        tmp_average[G] = pixel[G];
+        tmp_average[B] = pixel[B];
+        return;
+    }
+
+    // Slowly change the average buffer to match what is seen by the camera.
+    if ((pixel[R] > tmp_average[R]) & (tmp_average[R] < 255)) {
+        tmp_average[R] += ave_thresh;
+    } else if ((pixel[R] < tmp_average[R]) & (tmp_average[R] > 0)) {
+        tmp_average[R] -= ave_thresh;
+    }
+    if ((pixel[G] > tmp_average[G]) & (tmp_average[G] < 255)) {
+        tmp_average[G] += ave_thresh;
+    } else if ((pixel[G] < tmp_average[G]) & (tmp_average[G] > 0)) {
+        tmp_average[G] -= ave_thresh;
+    }
+    if ((pixel[B] > tmp_average[B]) & (tmp_average[B] < 255)) {
+        tmp_average[B] += ave_thresh;
+    } else if ((pixel[B] < tmp_average[B]) & (tmp_average[B] > 0)) {
+        tmp_average[B] -= ave_thresh;
+    }
+
+    // Scale the pixel to the lighting of the background so a cloud or
+    // a light switch does not register everywhere at once.
+    float r = pixel[R] * gain;
+    float g = pixel[G] * gain;
+    float b = pixel[B] * gain;
+
+    // difference between the average image and the current one for each colour.
+    int r_diff = r - tmp_average[R];
+    int g_diff = g - tmp_average[G];
+    int b_diff = b - tmp_average[B];
+
+    // difference between the colours.
+    // if all colours get brighter (or dimmer) by the same about, then val == 0.
+    // only if some colours change more than others do we register a change.
+    int col_change = abs(r_diff - g_diff) + abs(g_diff - b_diff) + abs(b_diff - r_diff);
+    if (col_change > 255) { col_change = 255; }
+
+    // difference in brightness of all 3 colours combined.
+    int bright_change = abs(r + g + b - tmp_average[R] - tmp_average[G] - tmp_average[B]) / 3;
+
+    if (col_change > col_thresh && bright_change > bright_thresh) {
+        //*tmp_movment = col_change;
+        *tmp_movment = (pixel[R] + pixel[G] + pixel[B]) / 3;
+    } else {
+        *tmp_movment = 0;
+    }
+}
+
+/* movment_kernel: The average detector. Always inlined, so each wrapper below
+ * gets a copy where shift, and with it every stride and cell count, is a constant.
+ */
+static inline __attribute__((always_inline)) void movment_kernel(unsigned char* _rgb_source_buf, const int shift) {
+    int cells_wide = capture_width >> shift;
+    int cells_high = capture_height >> shift;
+    int row, colum;
+    float *tmp_average = average_buf;
+    unsigned char *tmp_movment = movment_buf;
+    float gain = 1.0;
+
+    if (gain_regions && !first_run) {
+        estimate_gain(_rgb_source_buf);
+    }
+
+    for(row = 0; row < cells_high; row++){
+        // Top left pixel of each scale x scale block.
+        unsigned char *pixel = _rgb_source_buf + (row << shift) * capture_width * 3;
+        for(colum = 0; colum < cells_wide; colum++){
+            if (gain_regions) {
+                gain = region_gain[(row * gain_regions / cells_high) * gain_regions +
+                                   colum * gain_regions / cells_wide];
+            }
+            movment_cell(pixel, tmp_average, tmp_movment, gain);
+            tmp_average += 3;
+            tmp_movment++;
+            pixel += 3 << shift;
+        }
+    }
+}
+
+#define MOVMENT_KERNEL(shift) \
+    static void update_movment_##shift(unsigned char* _rgb_source_buf) { movment_kernel(_rgb_source_buf, shift); }
+
+MOVMENT_KERNEL(0)
+MOVMENT_KERNEL(1)
+MOVMENT_KERNEL(2)
+MOVMENT_KERNEL(3)
+MOVMENT_KERNEL(4)
+MOVMENT_KERNEL(5)
+MOVMENT_KERNEL(6)
+MOVMENT_KERNEL(7)
+
+// Indexed by log2(scale).
+static void (* const movment_kernels[])(unsigned char*) = {
+    update_movment_0, update_movment_1, update_movment_2, update_movment_3,
+    update_movment_4, update_movment_5, update_movment_6, update_movment_7,
+};
+
+/* The average detector as it was before movment_kernels[]: walk every pixel and
+ * test row % scale and colum % scale to find the sampled ones. Only --bench uses it.
+ */
+static void update_movment_modulo(unsigned char* _rgb_source_buf) {
+    int cells_wide = capture_width / scale;
+    int cells_high = capture_height / scale;
+    int row, colum;
+    float *tmp_average = average_buf;
+    unsigned char *tmp_movment = movment_buf;
+    float gain = 1.0;
+
+    if (gain_regions && !first_run) {
+        estimate_gain(_rgb_source_buf);
+    }
+
+    for(row = 0; row < capture_height / scale * scale; row++){
+        for(colum = 0; colum < capture_width; colum++){
+            if (!(row % scale) & !(colum % scale) & (colum < capture_width / scale * scale)) {
+                if (gain_regions) {
+                    gain = region_gain[(row / scale * gain_regions / cells_high) * gain_regions +
+                                       colum / scale * gain_regions / cells_wide];
+                }
+                movment_cell(_rgb_source_buf, tmp_average, tmp_movment, gain);
+                tmp_average += 3;
+                tmp_movment++;
+            }
+            _rgb_source_buf += 3;
+        }
+    }
+}
+
 static void init_buf()
 {
-    average_buf = malloc(sizeof(float) * 3 * capture_width * capture_height / (scale * scale));
-    if (!average_buf) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
+    size_t cells = capture_width * capture_height / (scale * scale);
+
+    // scale is final by now, --batch changes it.
+    update_movment = movment_kernels[__builtin_ctz(scale)];
+
+    average_buf = arena_alloc(&work_arena, sizeof(float) * 3 * cells);
+    average_char_buf = arena_alloc(&work_arena, sizeof(unsigned char) * 3 * cells);
+    movment_buf = arena_alloc(&work_arena, sizeof(unsigned char) * cells);
+    if (detector == DETECTOR_GAUSS) {
+        // Structure of arrays: all the R values, then G, then B.
+        gauss_x = arena_alloc(&work_arena, sizeof(float) * 3 * cells);
+        gauss_mean = arena_alloc(&work_arena, sizeof(float) * 3 * cells);
+        gauss_var = arena_alloc(&work_arena, sizeof(float) * cells);
     }
-    average_char_buf = malloc(sizeof(unsigned char) * 3 * capture_width * capture_height / (scale * scale));
-    if (!average_char_buf) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
+    if (detector == DETECTOR_SAD) {
+        luma_buf = arena_alloc(&work_arena, sizeof(unsigned char) * capture_width * capture_height);
+        last_luma_buf = arena_alloc(&work_arena, sizeof(unsigned char) * capture_width * capture_height);
     }
-    movment_buf = malloc(sizeof(unsigned char) * capture_width * capture_height / (scale * scale));
-    if (!movment_buf) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
+    if (idle_after) {
+        idle_scale = (scale * 4 > 128) ? 128 : scale * 4;
+        idle_luma_buf = arena_alloc(&work_arena, sizeof(unsigned char) * capture_width * capture_height);
+        idle_last_luma_buf = arena_alloc(&work_arena, sizeof(unsigned char) * capture_width * capture_height);
+        idle_movment_buf = arena_alloc(&work_arena,
+                                       sizeof(unsigned char) * capture_width * capture_height / (idle_scale * idle_scale));
+    }
+    blob_stack = arena_alloc(&work_arena, sizeof(int) * cells);
+    if (gain_regions) {
+        region_gain = arena_alloc(&work_arena, sizeof(float) * gain_regions * gain_regions);
+        region_sums = arena_alloc(&work_arena, sizeof(double) * 2 * gain_regions * gain_regions);
+    }
+    mask_init(&motion_mask, capture_width / scale, capture_height / scale);
+    mask_init(&scratch_mask, capture_width / scale, capture_height / scale);
+    mask_init(&blob_todo, capture_width / scale, capture_height / scale);
+    if (export_mask) {
+        rle_buf = arena_alloc(&work_arena, mask_rle_max(&motion_mask));
+    }
+    if (noisy_percent) {
+        heat = arena_alloc(&work_arena, sizeof(float) * cells);
+        heat_rgb = arena_alloc(&work_arena, sizeof(unsigned char) * 3 * cells);
+        memset(heat, 0, sizeof(float) * cells);
+        mask_init(&noisy_mask, capture_width / scale, capture_height / scale);
+        noisy_cells = 0;
+    }
+    int level;
+    for (level = 1; level <= pyramid_depth; level++) {
+        pyramid[level].width = capture_width >> level;
+        pyramid[level].height = capture_height >> level;
+        pyramid[level].length = sizeof(unsigned char) * pyramid[level].width * pyramid[level].height * 3;
+        pyramid[level].start = arena_alloc(&work_arena, pyramid[level].length);
     }
 //    rgb_buf = malloc(sizeof(unsigned char) * capture_width * capture_height * 3);
 //    if (!rgb_buf) {
@@ -188,132 +713,224 @@ static void init_buf()
 
 static void uninit_buf()
 {
-    free(average_buf);
-    free(average_char_buf);
-    free(movment_buf);
+    mask_free(&motion_mask);
+    mask_free(&scratch_mask);
+    mask_free(&blob_todo);
+    if (noisy_percent) {
+        mask_free(&noisy_mask);
+    }
+    // Everything else, the RGB frames from get_rgb() included.
+    arena_free(&work_arena);
 //    free(rgb_buf);
 }
 
-static void update_movment(unsigned char* _rgb_source_buf) {
-    int row, colum;
-    float *tmp_average = average_buf;
-    unsigned char *tmp_movment = movment_buf;
+/* Background model with a mean and variance per cell. Cells that flicker learn
+ * a wide variance and stop registering, steady cells stay sensitive. */
+static void update_movment_gauss(unsigned char* _rgb_source_buf) {
+    int cells_wide = capture_width / scale;
+    int cells_high = capture_height / scale;
+    int cells = cells_wide * cells_high;
+    int row, colum, i = 0;
+
+    // Gather the sampled pixels into planes so the model runs 8 cells at a time.
+    for (row = 0; row < cells_high; row++) {
+        unsigned char *pixel = _rgb_source_buf + row * scale * capture_width * 3;
+        for (colum = 0; colum < cells_wide; colum++) {
+            gauss_x[i] = pixel[R];
+            gauss_x[cells + i] = pixel[G];
+            gauss_x[2 * cells + i] = pixel[B];
+            pixel += scale * 3;
+            i++;
+        }
+    }
 
-    for(row = 0; row < capture_height; row++){
-        for(colum = 0; colum < capture_width; colum++){
-            if (!(row % scale) & !(colum % scale)) {
-                if (first_run) {
-                    // Copy the first frame into the average buffer.
-                    tmp_average[R] = _rgb_source_buf[R];
-                    tmp_average[G] = _rgb_source_buf[G];
-                    tmp_average[B] = _rgb_source_buf[B];
-                } else {
-                    // Slowly change the average buffer to match what is seen by the camera.
-                    if ((_rgb_source_buf[R] > tmp_average[R]) & (tmp_average[R] < 255)) {
-                        tmp_average[R] += ave_thresh;
-                    } else if ((_rgb_source_buf[R] < tmp_average[R]) & (tmp_average[R] > 0)) {
-                        tmp_average[R] -= ave_thresh;
-                    }
-                    if ((_rgb_source_buf[G] > tmp_average[G]) & (tmp_average[G] < 255)) {
-                        tmp_average[G] += ave_thresh;
-                    } else if ((_rgb_source_buf[G] < tmp_average[G]) & (tmp_average[G] > 0)) {
-                        tmp_average[G] -= ave_thresh;
-                    }
-                    if ((_rgb_source_buf[B] > tmp_average[B]) & (tmp_average[B] < 255)) {
-                        tmp_average[B] += ave_thresh;
-                    } else if ((_rgb_source_buf[B] < tmp_average[B]) & (tmp_average[B] > 0)) {
-                        tmp_average[B] -= ave_thresh;
-                    }
+    if (first_run) {
+        memcpy(gauss_mean, gauss_x, sizeof(float) * 3 * cells);
+        for (i = 0; i < cells; i++) {
+            gauss_var[i] = GAUSS_START_VAR;
+        }
+        memset(movment_buf, 0, cells);
+        return;
+    }
+    gauss_update(gauss_x, gauss_mean, gauss_var, cells, GAUSS_ALPHA, sigma * sigma, GAUSS_MIN_VAR, movment_buf);
+}
 
-                    // difference between the average image and the current one for each colour.
-                    int r_diff = _rgb_source_buf[R] - tmp_average[R];
-                    int g_diff = _rgb_source_buf[G] - tmp_average[G];
-                    int b_diff = _rgb_source_buf[B] - tmp_average[B];
-
-                    // difference between the colours.
-                    // if all colours get brighter (or dimmer) by the same about, then val == 0.
-                    // only if some colours change more than others do we register a change.
-                    int col_change = abs(r_diff - g_diff) + abs(g_diff - b_diff) + abs(b_diff - r_diff);
-                    if (col_change > 255) { col_change = 255; }
-
-                    // difference in brightness of all 3 colours combined.
-                    int bright_change = abs(_rgb_source_buf[R] + _rgb_source_buf[G] + _rgb_source_buf[B] -
-                                            tmp_average[R] - tmp_average[G] - tmp_average[B]) / 3;
-
-                    if (col_change > col_thresh && bright_change > bright_thresh) {
-                        //*tmp_movment = col_change;
-                        *tmp_movment = (_rgb_source_buf[R] + _rgb_source_buf[G] + _rgb_source_buf[B]) / 3;
-                    } else {
-                        *tmp_movment = 0;
-                    }
-                }
-                tmp_average += 3;
-                tmp_movment++;
-            }
-            _rgb_source_buf += 3;
+/* check_flood: Treat movment over more than flood_percent of the cells as a
+ * lighting change rather than something moving. Drops the frame's movment and,
+ * for the background detectors, takes the frame as the new background.
+ * Call after mask_movment().
+ * Arguments:
+ *      (unsigned char*)_rgb_source_buf: The frame. (DETECTOR_AVERAGE, DETECTOR_GAUSS)
+ *      (struct timespec*)now:           When the frame arrived.
+ */
+static void check_flood(unsigned char* _rgb_source_buf, struct timespec* now)
+{
+    int cells = (capture_width / scale) * (capture_height / scale);
+
+    if (!flood_percent || active_cells * 100 <= flood_percent * cells) {
+        return;
+    }
+
+    printf("flood %li.%09li cells=%i\n", (long)now->tv_sec, now->tv_nsec, active_cells);
+    fflush(stdout);
+    memset(movment_buf, 0, cells);
+    mask_from_cells(&motion_mask, movment_buf);
+    active_cells = 0;
+
+    if (detector == DETECTOR_AVERAGE) {
+        first_run = 1;
+        update_movment(_rgb_source_buf);
+        first_run = 0;
+    } else if (detector == DETECTOR_GAUSS) {
+        first_run = 1;
+        update_movment_gauss(_rgb_source_buf);
+        first_run = 0;
+    }
+}
+
+/* Y plane of last_frame, capture_width bytes per row. Unpadded planar formats are
+ * read in place, others are copied out into scratch. */
+static const unsigned char* frame_luma(unsigned char* scratch)
+{
+    int row;
+
+    if (pix_format->luma_plane && plane_stride[0] == (unsigned int)capture_width) {
+        return frame_planes[0];
+    }
+    if (!pix_format->luma_plane && plane_stride[0] == (unsigned int)capture_width * 2) {
+        yuyv_to_luma(frame_planes[0], scratch, capture_width * capture_height);
+        return scratch;
+    }
+    for (row = 0; row < capture_height; row++) {
+        const unsigned char* src = frame_planes[0] + (size_t)row * plane_stride[0];
+        if (pix_format->luma_plane) {
+            memcpy(scratch + row * capture_width, src, capture_width);
+        } else {
+            yuyv_to_luma(src, scratch + row * capture_width, capture_width);
         }
     }
+    return scratch;
+}
+
+/* Keep the Y plane from frame_luma() as the previous frame for next time. */
+static void keep_luma(const unsigned char* luma, unsigned char** scratch, unsigned char** last)
+{
+    unsigned char *tmp;
+
+    if (luma == *scratch) {
+        tmp = *last;
+        *last = *scratch;
+        *scratch = tmp;
+    } else {
+        memcpy(*last, luma, capture_width * capture_height);
+    }
+}
+
+/* Frame to frame detector. Reacts on the very next frame but does not see things
+ * that have stopped moving. */
+static void update_movment_sad(void) {
+    const unsigned char *luma = frame_luma(luma_buf);
+
+    if (first_run) {
+        memset(movment_buf, 0, capture_width * capture_height / (scale * scale));
+    } else {
+        block_sad(last_luma_buf, luma, capture_width, capture_height, scale, movment_buf, bright_thresh);
+    }
+    keep_luma(luma, &luma_buf, &last_luma_buf);
 }
 
 #define MAXSIZE 16
 static void display_image(void *p_buffer)
 {
+    int cells_wide = capture_width / scale;
+    int cells_high = capture_height / scale;
+    int step = (scale < MAXSIZE) ? MAXSIZE / scale : 1;    // Cells per character pair.
     int row, colum;
     int val;
     unsigned char *tmp = p_buffer;
-    
-    //int scale_remainder = 0;
-    //if (scale < MAXSIZE) {
-    //    scale_remainder = MAXSIZE - scale;
-    //}
 
     fprintf(stderr, "\n+");
-    for(colum = 0; colum < capture_width; colum += scale){
-        if (!(colum % MAXSIZE)) {
-            fprintf(stderr, "--");
-        }
+    for(colum = 0; colum < cells_wide; colum += step){
+        fprintf(stderr, "--");
     }
     fprintf(stderr, "+\n|");
-    for(row = 0; row < capture_height; row += scale){
-        if (!(row % MAXSIZE)) {
-            if (row) fprintf(stderr, "|\n|");
-        }
-        for(colum = 0; colum < capture_width; colum += scale){
-            if (!(colum % MAXSIZE) & !(row % MAXSIZE)) {
-                val = *tmp;
-                if (val < 20) {
-                    fprintf(stderr, "  ");
-                } else if ( val < 40) {
-                    fprintf(stderr, "..");
-                } else if ( val < 60) {
-                    fprintf(stderr, "--");
-                } else if ( val < 80) {
-                    fprintf(stderr, "~~");
-                } else if ( val < 100) {
-                    fprintf(stderr, "**");
-                } else if ( val < 150) {
-                    fprintf(stderr, "xx");
-                } else if ( val < 200) {
-                    fprintf(stderr, "XX");
-                } else {
-                    fprintf(stderr, "##");
-                }
+    for(row = 0; row < cells_high; row += step){
+        if (row) fprintf(stderr, "|\n|");
+        for(colum = 0; colum < cells_wide; colum += step){
+            val = tmp[row * cells_wide + colum];
+            if (val < 20) {
+                fprintf(stderr, "  ");
+            } else if ( val < 40) {
+                fprintf(stderr, "..");
+            } else if ( val < 60) {
+                fprintf(stderr, "--");
+            } else if ( val < 80) {
+                fprintf(stderr, "~~");
+            } else if ( val < 100) {
+                fprintf(stderr, "**");
+            } else if ( val < 150) {
+                fprintf(stderr, "xx");
+            } else if ( val < 200) {
+                fprintf(stderr, "XX");
+            } else {
+                fprintf(stderr, "##");
             }
-            tmp++;
         }
     }
     fprintf(stderr, "|\n+");
-    for(colum = 0; colum < capture_width; colum += scale){
-        if (!(colum % MAXSIZE)) {
-            fprintf(stderr, "--");
-        }
+    for(colum = 0; colum < cells_wide; colum += step){
+        fprintf(stderr, "--");
     }
     fprintf(stderr, "+\n");
 }
 
+/* Fill in the fields every VIDIOC_QUERYBUF, VIDIOC_QBUF and VIDIOC_DQBUF needs. */
+static void prepare_buf(struct v4l2_buffer* buf, struct v4l2_plane* planes, enum v4l2_memory memory)
+{
+        CLEAR(*buf);
+        buf->type = buf_type;
+        buf->memory = memory;
+        if (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+                memset(planes, 0, sizeof(*planes) * VIDEO_MAX_PLANES);
+                buf->m.planes = planes;
+                buf->length = n_planes;
+        }
+}
+
+/* Give a mmap buffer back to the device once every consumer is done with it. */
+static void requeue_buffer(int index)
+{
+        struct v4l2_buffer buf;
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+
+        prepare_buf(&buf, planes, V4L2_MEMORY_MMAP);
+        buf.index = index;
+
+        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+                errno_exit("VIDIOC_QBUF");
+}
+
+/* Offer a dequeued buffer to the share_name consumers.
+ * Returns the number of consumers now holding it. */
+static int share_buffer(const struct v4l2_buffer* buf)
+{
+        struct share_msg frame;
+
+        CLEAR(frame);
+        frame.type = SHARE_FRAME;
+        frame.index = buf->index;
+        frame.bytesused = (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ? buf->m.planes[0].bytesused
+                                                                         : buf->bytesused;
+        frame.sequence = buf->sequence;
+        frame.timestamp_ns = (int64_t)buf->timestamp.tv_sec * BILLION + buf->timestamp.tv_usec * 1000;
+        return share_frame(&frame);
+}
+
 static int read_frame(void)
 {
         struct v4l2_buffer buf;
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+        unsigned long userptr;
         unsigned int i;
 
         switch (io) {
@@ -333,14 +950,11 @@ static int read_frame(void)
                     }
                 }
 
-                process_image(buffers[0].start, buffers[0].length);
+                process_image(buffers[0].planes, NULL, buffers[0].length);
                 break;
 
             case IO_METHOD_MMAP:
-                CLEAR(buf);
-
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_MMAP;
+                prepare_buf(&buf, planes, V4L2_MEMORY_MMAP);
 
                 if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
                     switch (errno) {
@@ -359,17 +973,19 @@ static int read_frame(void)
 
                 assert(buf.index < n_buffers);
 
-                process_image(buffers[buf.index].start, buf.bytesused);
+                process_image(buffers[buf.index].planes,
+                              (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ? planes : NULL, buf.bytesused);
+
+                // Consumers holding it requeue it through requeue_buffer().
+                if (share_name && share_buffer(&buf))
+                    break;
 
                 if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
                     errno_exit("VIDIOC_QBUF");
                 break;
 
             case IO_METHOD_USERPTR:
-                CLEAR(buf);
-
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_USERPTR;
+                prepare_buf(&buf, planes, V4L2_MEMORY_USERPTR);
 
                 if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
                     switch (errno) {
@@ -383,14 +999,19 @@ static int read_frame(void)
                     }
                 }
 
+                if (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+                    userptr = planes[0].m.userptr;
+                else
+                    userptr = buf.m.userptr;
+
                 for (i = 0; i < n_buffers; ++i)
-                    if (buf.m.userptr == (unsigned long)buffers[i].start
-                            && buf.length == buffers[i].length)
+                    if (userptr == (unsigned long)buffers[i].start)
                         break;
 
                 assert(i < n_buffers);
 
-                process_image((void *)buf.m.userptr, buf.bytesused);
+                process_image(buffers[i].planes,
+                              (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ? planes : NULL, buf.bytesused);
 
                 if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
                     errno_exit("VIDIOC_QBUF");
@@ -408,14 +1029,17 @@ static void mainloop(void)
         struct timeval tv;
         int r;
 
+        int max_fd = fd;
+
         FD_ZERO(&fds);
         FD_SET(fd, &fds);
+        share_fds(&fds, &max_fd);
 
         /* Timeout. */
         tv.tv_sec = 2;
         tv.tv_usec = 0;
 
-        r = select(fd + 1, &fds, NULL, NULL, &tv);
+        r = select(max_fd + 1, &fds, NULL, NULL, &tv);
 
         if (-1 == r) {
             if (EINTR == errno)
@@ -428,6 +1052,10 @@ static void mainloop(void)
             exit(EXIT_FAILURE);
         }
 
+        share_service(&fds);
+        if (!FD_ISSET(fd, &fds))
+            continue;
+
         if (read_frame())
             break;
         /* EAGAIN - continue select loop. */
@@ -445,7 +1073,7 @@ static void stop_capturing(void)
 
         case IO_METHOD_MMAP:
         case IO_METHOD_USERPTR:
-                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                type = buf_type;
                 if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
                         errno_exit("VIDIOC_STREAMOFF");
                 break;
@@ -454,7 +1082,7 @@ static void stop_capturing(void)
 
 static void start_capturing(void)
 {
-        unsigned int i;
+        unsigned int i, j;
         enum v4l2_buf_type type;
 
         switch (io) {
@@ -465,16 +1093,15 @@ static void start_capturing(void)
         case IO_METHOD_MMAP:
                 for (i = 0; i < n_buffers; ++i) {
                         struct v4l2_buffer buf;
+                        struct v4l2_plane planes[VIDEO_MAX_PLANES];
 
-                        CLEAR(buf);
-                        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                        buf.memory = V4L2_MEMORY_MMAP;
+                        prepare_buf(&buf, planes, V4L2_MEMORY_MMAP);
                         buf.index = i;
 
                         if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
                                 errno_exit("VIDIOC_QBUF");
                 }
-                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                type = buf_type;
                 if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
                         errno_exit("VIDIOC_STREAMON");
                 break;
@@ -482,42 +1109,66 @@ static void start_capturing(void)
         case IO_METHOD_USERPTR:
                 for (i = 0; i < n_buffers; ++i) {
                         struct v4l2_buffer buf;
+                        struct v4l2_plane planes[VIDEO_MAX_PLANES];
 
-                        CLEAR(buf);
-                        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                        buf.memory = V4L2_MEMORY_USERPTR;
+                        prepare_buf(&buf, planes, V4L2_MEMORY_USERPTR);
                         buf.index = i;
-                        buf.m.userptr = (unsigned long)buffers[i].start;
-                        buf.length = buffers[i].length;
+                        if (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+                                for (j = 0; j < n_planes; ++j) {
+                                        planes[j].m.userptr = (unsigned long)buffers[i].planes[j];
+                                        planes[j].length = buffers[i].plane_length[j];
+                                }
+                        } else {
+                                buf.m.userptr = (unsigned long)buffers[i].start;
+                                buf.length = buffers[i].length;
+                        }
 
                         if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
                                 errno_exit("VIDIOC_QBUF");
                 }
-                type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                type = buf_type;
                 if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
                         errno_exit("VIDIOC_STREAMON");
                 break;
         }
 }
 
+/* Hand the driver's buffers back so the format can be changed. */
+static void release_buffers(enum v4l2_memory memory)
+{
+        struct v4l2_requestbuffers req;
+
+        CLEAR(req);
+        req.count  = 0;
+        req.type   = buf_type;
+        req.memory = memory;
+
+        xioctl(fd, VIDIOC_REQBUFS, &req);       // Errors ignored
+}
+
 static void uninit_device(void)
 {
-        unsigned int i;
+        unsigned int i, j;
 
         switch (io) {
         case IO_METHOD_READ:
-                free(buffers[0].start);
+                arena_free(&capture_arena);
                 break;
 
         case IO_METHOD_MMAP:
                 for (i = 0; i < n_buffers; ++i)
-                        if (-1 == munmap(buffers[i].start, buffers[i].length))
-                                errno_exit("munmap");
+                        for (j = 0; j < n_planes; ++j) {
+                                if (-1 == munmap(buffers[i].planes[j], buffers[i].plane_length[j]))
+                                        errno_exit("munmap");
+                                if (share_name)
+                                        close(buffers[i].dmabuf[j]);
+                        }
+                release_buffers(V4L2_MEMORY_MMAP);
                 break;
 
         case IO_METHOD_USERPTR:
-                for (i = 0; i < n_buffers; ++i)
-                        free(buffers[i].start);
+                arena_free(&capture_arena);
+                release_buffers(V4L2_MEMORY_USERPTR);
                 break;
         }
 
@@ -534,22 +1185,20 @@ static void init_read(unsigned int buffer_size)
         }
 
         buffers[0].length = buffer_size;
-        buffers[0].start = malloc(buffer_size);
-
-        if (!buffers[0].start) {
-                fprintf(stderr, "Out of memory\n");
-                exit(EXIT_FAILURE);
-        }
+        buffers[0].start = arena_alloc(&capture_arena, buffer_size);
+        buffers[0].planes[0] = buffers[0].start;
+        buffers[0].plane_length[0] = buffer_size;
 }
 
 static void init_mmap(void)
 {
         struct v4l2_requestbuffers req;
+        unsigned int j;
 
         CLEAR(req);
 
         req.count = 4;
-        req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        req.type = buf_type;
         req.memory = V4L2_MEMORY_MMAP;
 
         if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
@@ -577,37 +1226,92 @@ static void init_mmap(void)
 
         for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
                 struct v4l2_buffer buf;
+                struct v4l2_plane planes[VIDEO_MAX_PLANES];
 
-                CLEAR(buf);
-
-                buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory      = V4L2_MEMORY_MMAP;
+                prepare_buf(&buf, planes, V4L2_MEMORY_MMAP);
                 buf.index       = n_buffers;
 
                 if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
                         errno_exit("VIDIOC_QUERYBUF");
 
-                buffers[n_buffers].length = buf.length;
-                buffers[n_buffers].start =
-                        mmap(NULL /* start anywhere */,
-                              buf.length,
-                              PROT_READ | PROT_WRITE /* required */,
-                              MAP_SHARED /* recommended */,
-                              fd, buf.m.offset);
+                for (j = 0; j < n_planes; ++j) {
+                        size_t length = buf.length;
+                        off_t offset = buf.m.offset;
+
+                        if (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+                                length = planes[j].length;
+                                offset = planes[j].m.mem_offset;
+                        }
+
+                        buffers[n_buffers].plane_length[j] = length;
+                        buffers[n_buffers].planes[j] =
+                                mmap(NULL /* start anywhere */,
+                                      length,
+                                      PROT_READ | PROT_WRITE /* required */,
+                                      MAP_SHARED /* recommended */,
+                                      fd, offset);
+
+                        if (MAP_FAILED == buffers[n_buffers].planes[j])
+                                errno_exit("mmap");
+                }
+                buffers[n_buffers].start = buffers[n_buffers].planes[0];
+                buffers[n_buffers].length = buffers[n_buffers].plane_length[0];
+        }
+}
+
+/* export_buffers: Export every plane of every mmap buffer as a dmabuf and
+ * start offering frames to consumers on share_name. */
+static void export_buffers(void)
+{
+        struct share_msg hello;
+        int fds[SHARE_MAX_BUFFERS * SHARE_MAX_PLANES];
+        unsigned int i, j;
+
+        if (n_buffers > SHARE_MAX_BUFFERS || n_planes > SHARE_MAX_PLANES) {
+                fprintf(stderr, "Too many buffers to share\n");
+                exit(EXIT_FAILURE);
+        }
 
-                if (MAP_FAILED == buffers[n_buffers].start)
-                        errno_exit("mmap");
+        for (i = 0; i < n_buffers; ++i) {
+                for (j = 0; j < n_planes; ++j) {
+                        struct v4l2_exportbuffer exp;
+
+                        CLEAR(exp);
+                        exp.type = buf_type;
+                        exp.index = i;
+                        exp.plane = j;
+                        exp.flags = O_RDONLY | O_CLOEXEC;
+
+                        if (-1 == xioctl(fd, VIDIOC_EXPBUF, &exp)) {
+                                if (EINVAL == errno || ENOTTY == errno) {
+                                        fprintf(stderr, "%s cannot export buffers as dmabuf\n", dev_name);
+                                        exit(EXIT_FAILURE);
+                                }
+                                errno_exit("VIDIOC_EXPBUF");
+                        }
+                        buffers[i].dmabuf[j] = exp.fd;
+                        fds[i * n_planes + j] = exp.fd;
+                }
         }
+
+        CLEAR(hello);
+        hello.width = capture_width;
+        hello.height = capture_height;
+        hello.fourcc = pix_format->fourcc;
+        hello.n_buffers = n_buffers;
+        hello.n_planes = n_planes;
+        share_init(share_name, &hello, fds, requeue_buffer);
 }
 
-static void init_userp(unsigned int buffer_size)
+static void init_userp(const unsigned int* plane_sizes)
 {
         struct v4l2_requestbuffers req;
+        unsigned int j;
 
         CLEAR(req);
 
         req.count  = 4;
-        req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        req.type   = buf_type;
         req.memory = V4L2_MEMORY_USERPTR;
 
         if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
@@ -628,71 +1332,441 @@ static void init_userp(unsigned int buffer_size)
         }
 
         for (n_buffers = 0; n_buffers < 4; ++n_buffers) {
-                buffers[n_buffers].length = buffer_size;
-                buffers[n_buffers].start = malloc(buffer_size);
-
-                if (!buffers[n_buffers].start) {
-                        fprintf(stderr, "Out of memory\n");
-                        exit(EXIT_FAILURE);
+                for (j = 0; j < n_planes; ++j) {
+                        buffers[n_buffers].plane_length[j] = plane_sizes[j];
+                        buffers[n_buffers].planes[j] = arena_alloc_aligned(&capture_arena, plane_sizes[j],
+                                                                            sysconf(_SC_PAGESIZE));
                 }
+                buffers[n_buffers].start = buffers[n_buffers].planes[0];
+                buffers[n_buffers].length = buffers[n_buffers].plane_length[0];
         }
 }
 
-static void init_device(void)
+/* Highest frame rate the device offers for a pixel format and frame size.
+ * Returns 0 if the driver does not enumerate frame intervals. */
+static unsigned int max_frame_rate(unsigned int pixelformat, unsigned int width, unsigned int height)
 {
-        struct v4l2_capability cap;
-        struct v4l2_cropcap cropcap;
-        struct v4l2_crop crop;
-        struct v4l2_format fmt;
-        struct v4l2_control control;
-        unsigned int min;
-
-        if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
-                if (EINVAL == errno) {
-                        fprintf(stderr, "%s is no V4L2 device\n",
-                                 dev_name);
-                        exit(EXIT_FAILURE);
+        struct v4l2_frmivalenum ival;
+        unsigned int best = 0;
+
+        CLEAR(ival);
+        ival.pixel_format = pixelformat;
+        ival.width = width;
+        ival.height = height;
+
+        while (0 == xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival)) {
+                struct v4l2_fract *f;
+                if (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+                        f = &ival.discrete;
                 } else {
-                        errno_exit("VIDIOC_QUERYCAP");
+                        // Stepwise or continuous. The smallest interval is the fastest rate.
+                        f = &ival.stepwise.min;
                 }
+                if (f->numerator && f->denominator / f->numerator > best)
+                        best = f->denominator / f->numerator;
+                if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+                        break;
+                ival.index++;
         }
 
-        if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-                fprintf(stderr, "%s is no video capture device\n",
-                         dev_name);
-                exit(EXIT_FAILURE);
-        }
-
-        switch (io) {
-        case IO_METHOD_READ:
-                if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-                        fprintf(stderr, "%s does not support read i/o\n",
-                                 dev_name);
-                        exit(EXIT_FAILURE);
-                }
-                break;
+        return best;
+}
 
-        case IO_METHOD_MMAP:
-        case IO_METHOD_USERPTR:
-                if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-                        fprintf(stderr, "%s does not support streaming i/o\n",
-                                 dev_name);
-                        exit(EXIT_FAILURE);
-                }
-                break;
-        }
+/* Cost of capturing and converting one frame in a mode. */
+static unsigned long mode_cost(const struct mode* m)
+{
+        return (unsigned long)m->width * m->height * m->format->bits_per_pixel;
+}
 
+/* Consider one frame size as a detection mode and as a snapshot mode. */
+static void consider_frame_size(const struct pix_format* format, unsigned int width, unsigned int height,
+                                struct mode* best)
+{
+        struct mode m = { width, height, format };
+        unsigned int fps;
 
-        /* Select video input, video standard and tune here. */
+        /* The average detector needs colour: with r == g == b nothing ever moves.
+         * init_io() refuses GREY for it, so it must not be the snapshot mode either. */
+        if (detector == DETECTOR_AVERAGE && format->fourcc == V4L2_PIX_FMT_GREY)
+                return;
 
+        if (width * height > full_mode.width * full_mode.height)
+                full_mode = m;
 
-        CLEAR(cropcap);
+        if (width < detect_width || height < detect_height)
+                return;
+        if (best->format && mode_cost(&m) >= mode_cost(best))
+                return;
 
-        cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        fps = max_frame_rate(format->fourcc, width, height);
+        if (fps && fps < detect_fps)
+                return;
 
-        if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
-                crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                crop.c = cropcap.defrect; /* reset to default */
+        *best = m;
+}
+
+/* negotiate_format: Find the cheapest supported format and frame size that is
+ * at least detect_width x detect_height and can run at detect_fps.
+ * Also records the largest mode in full_mode for snapshots.
+ */
+static void negotiate_format(struct mode* best)
+{
+        struct v4l2_fmtdesc desc;
+        struct v4l2_frmsizeenum size;
+
+        CLEAR(*best);
+
+        CLEAR(desc);
+        desc.type = buf_type;
+        while (0 == xioctl(fd, VIDIOC_ENUM_FMT, &desc)) {
+                const struct pix_format* format = find_pix_format(desc.pixelformat);
+                desc.index++;
+                if (!format)
+                        continue;
+
+                CLEAR(size);
+                size.pixel_format = format->fourcc;
+                while (0 == xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size)) {
+                        if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                                consider_frame_size(format, size.discrete.width, size.discrete.height, best);
+                                size.index++;
+                                continue;
+                        }
+
+                        // Stepwise or continuous: round the request up to the next step.
+                        struct v4l2_frmsize_stepwise *sw = &size.stepwise;
+                        unsigned int step_w = sw->step_width ? sw->step_width : 1;
+                        unsigned int step_h = sw->step_height ? sw->step_height : 1;
+                        unsigned int w = sw->min_width, h = sw->min_height;
+                        if (detect_width > w)
+                                w += (detect_width - w + step_w - 1) / step_w * step_w;
+                        if (detect_height > h)
+                                h += (detect_height - h + step_h - 1) / step_h * step_h;
+                        if (w <= sw->max_width && h <= sw->max_height)
+                                consider_frame_size(format, w, h, best);
+                        consider_frame_size(format, sw->max_width, sw->max_height, best);
+                        break;
+                }
+        }
+
+        if (!full_mode.format) {
+                fprintf(stderr, "%s offers no supported format and frame size%s\n", dev_name,
+                         detector == DETECTOR_AVERAGE ? " in colour, which --detector average needs" : "");
+                exit(EXIT_FAILURE);
+        }
+        if (!best->format) {
+                fprintf(stderr, "No mode on %s meets %ux%u at %u fps. Using %ux%u.\n",
+                         dev_name, detect_width, detect_height, detect_fps,
+                         full_mode.width, full_mode.height);
+                *best = full_mode;
+        }
+}
+
+/* Ask for a format and size. Note VIDIOC_S_FMT may change width and height. */
+static void set_format(struct v4l2_format* fmt, const struct mode* m)
+{
+        CLEAR(*fmt);
+        fmt->type = buf_type;
+        if (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+                fmt->fmt.pix_mp.width       = m->width;
+                fmt->fmt.pix_mp.height      = m->height;
+                fmt->fmt.pix_mp.pixelformat = m->format->fourcc;
+                fmt->fmt.pix_mp.field       = V4L2_FIELD_ANY;
+        } else {
+                fmt->fmt.pix.width          = m->width;
+                fmt->fmt.pix.height         = m->height;
+                fmt->fmt.pix.pixelformat    = m->format->fourcc;
+                fmt->fmt.pix.field          = V4L2_FIELD_INTERLACED;
+        }
+
+        if (-1 == xioctl(fd, VIDIOC_S_FMT, fmt))
+                errno_exit("VIDIOC_S_FMT");
+}
+
+static void set_frame_rate(unsigned int fps)
+{
+        struct v4l2_streamparm parm;
+
+        CLEAR(parm);
+        parm.type = buf_type;
+        parm.parm.capture.timeperframe.numerator = 1;
+        parm.parm.capture.timeperframe.denominator = fps;
+
+        xioctl(fd, VIDIOC_S_PARM, &parm);       // Errors ignored
+}
+
+/* Pick the kernels for, and allocate or map capture buffers for, the format
+ * now set on the device. */
+static void init_io(struct v4l2_format* fmt)
+{
+        unsigned int plane_sizes[VIDEO_MAX_PLANES];
+        unsigned int bytesperline[VIDEO_MAX_PLANES];
+        unsigned int fourcc, min, j;
+
+        if (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+                fourcc = fmt->fmt.pix_mp.pixelformat;
+                capture_width = fmt->fmt.pix_mp.width;
+                capture_height = fmt->fmt.pix_mp.height;
+                n_planes = fmt->fmt.pix_mp.num_planes;
+                if (n_planes > 3)
+                        n_planes = 3;   /* Rejected below. */
+                for (j = 0; j < n_planes; ++j) {
+                        plane_sizes[j] = fmt->fmt.pix_mp.plane_fmt[j].sizeimage;
+                        bytesperline[j] = fmt->fmt.pix_mp.plane_fmt[j].bytesperline;
+                }
+        } else {
+                fourcc = fmt->fmt.pix.pixelformat;
+                capture_width = fmt->fmt.pix.width;
+                capture_height = fmt->fmt.pix.height;
+                n_planes = 1;
+        }
+
+        pix_format = find_pix_format(fourcc);
+        if (!pix_format) {
+                fprintf(stderr, "%s: pixel format %.4s is not supported\n",
+                         dev_name, (char*)&fourcc);
+                exit(EXIT_FAILURE);
+        }
+        if (detector == DETECTOR_AVERAGE && fourcc == V4L2_PIX_FMT_GREY) {
+                fprintf(stderr, "%s: %.4s has no colour, which --detector average needs. "
+                         "Use --detector sad or gauss.\n", dev_name, (char*)&fourcc);
+                exit(EXIT_FAILURE);
+        }
+        if (n_planes != (unsigned int)pix_format->mem_planes) {
+                fprintf(stderr, "%s: %.4s has %u planes, expected %i\n",
+                         dev_name, (char*)&fourcc, n_planes, pix_format->mem_planes);
+                exit(EXIT_FAILURE);
+        }
+
+        if (buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+                /* Buggy driver paranoia. */
+                min = fmt->fmt.pix.width * pix_format->line_bytes;
+                if (fmt->fmt.pix.bytesperline < min)
+                        fmt->fmt.pix.bytesperline = min;
+                min = fmt->fmt.pix.bytesperline * fmt->fmt.pix.height *
+                        pix_format->bits_per_pixel / (8 * pix_format->line_bytes);
+                if (fmt->fmt.pix.sizeimage < min)
+                        fmt->fmt.pix.sizeimage = min;
+                plane_sizes[0] = fmt->fmt.pix.sizeimage;
+                bytesperline[0] = fmt->fmt.pix.bytesperline;
+        } else {
+                /* Same paranoia. Chroma planes of YUV420M are half as wide. */
+                for (j = 0; j < n_planes; ++j) {
+                        min = (j && pix_format->planes == 3) ? capture_width / 2 : capture_width;
+                        if (bytesperline[j] < min)
+                                bytesperline[j] = min;
+                        min = bytesperline[j] * ((j ? capture_height / 2 : capture_height));
+                        if (plane_sizes[j] < min)
+                                plane_sizes[j] = min;
+                }
+        }
+        set_plane_layout(bytesperline, plane_sizes);
+
+        switch (io) {
+        case IO_METHOD_READ:
+                init_read(plane_sizes[0]);
+                break;
+
+        case IO_METHOD_MMAP:
+                init_mmap();
+                break;
+
+        case IO_METHOD_USERPTR:
+                init_userp(plane_sizes);
+                break;
+        }
+
+    fprintf(stderr,"Image width set to %i by device %s.\n", capture_width, dev_name);
+    fprintf(stderr,"Image height set to %i by device %s.\n", capture_height, dev_name);
+    fprintf(stderr,"Pixel format set to %.4s by device %s.\n", (char*)&fourcc, dev_name);
+}
+
+/* Fill in the key of a device_cache for the open device. The rest is zeroed. */
+static void device_cache_key(struct device_cache* dc, const struct v4l2_capability* cap)
+{
+        struct stat st;
+
+        memset(dc, 0, sizeof(*dc));
+        memcpy(dc->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        memcpy(dc->card, cap->card, sizeof(dc->card));
+        memcpy(dc->bus_info, cap->bus_info, sizeof(dc->bus_info));
+        if (0 == fstat(fd, &st)) {
+                dc->rdev = st.st_rdev;
+                dc->node_ctime = st.st_ctim;
+        }
+        dc->buf_type = buf_type;
+        dc->detect_width = detect_width;
+        dc->detect_height = detect_height;
+        dc->detect_fps = detect_fps;
+        dc->detector = detector;
+}
+
+/* load_device_cache: Take detect_mode and full_mode from --cache if it was written
+ * for this device, node and set of flags.
+ * Returns:
+ *      (int): 1 if the cache was used. Otherwise 0.
+ */
+static int load_device_cache(const struct v4l2_capability* cap)
+{
+        struct device_cache want, have;
+        FILE* fp;
+        size_t n;
+
+        if (!cache_name || !(fp = fopen(cache_name, "rb")))
+                return 0;
+        n = fread(&have, sizeof(have), 1, fp);
+        fclose(fp);
+
+        device_cache_key(&want, cap);
+        if (n != 1 || memcmp(&want, &have, offsetof(struct device_cache, detect_fourcc)))
+                return 0;
+
+        detect_mode.width = have.detect_mode_width;
+        detect_mode.height = have.detect_mode_height;
+        detect_mode.format = find_pix_format(have.detect_fourcc);
+        full_mode.width = have.full_mode_width;
+        full_mode.height = have.full_mode_height;
+        full_mode.format = find_pix_format(have.full_fourcc);
+        if ((detect_width || detect_height) && (!detect_mode.format || !full_mode.format)) {
+                CLEAR(detect_mode);
+                CLEAR(full_mode);
+                return 0;
+        }
+        return 1;
+}
+
+static void save_device_cache(const struct v4l2_capability* cap)
+{
+        struct device_cache dc;
+        FILE* fp;
+
+        if (!cache_name)
+                return;
+        device_cache_key(&dc, cap);
+        if (detect_mode.format) {
+                dc.detect_fourcc = detect_mode.format->fourcc;
+                dc.detect_mode_width = detect_mode.width;
+                dc.detect_mode_height = detect_mode.height;
+        }
+        if (full_mode.format) {
+                dc.full_fourcc = full_mode.format->fourcc;
+                dc.full_mode_width = full_mode.width;
+                dc.full_mode_height = full_mode.height;
+        }
+
+        fp = fopen(cache_name, "wb");
+        if (!fp || fwrite(&dc, sizeof(dc), 1, fp) != 1) {
+                // Only costs a probe next time.
+                fprintf(stderr, "Cannot write '%s': %d, %s\n", cache_name, errno, strerror(errno));
+        }
+        if (fp)
+                fclose(fp);
+}
+
+/* Turn off anything that might auto-adjust the brightness/contrast. */
+static void disable_auto_controls(void)
+{
+    struct v4l2_control control;
+
+    // "$ v4l2-ctl -l" lets us see what our camera is capable of (and set to).
+    memset (&control, 0, sizeof (control));
+    control.id = V4L2_CID_AUTO_WHITE_BALANCE;
+    control.value = 0;
+    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
+    memset (&control, 0, sizeof (control));
+    control.id = V4L2_CID_RED_BALANCE;
+    control.value = 0;
+    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
+    memset (&control, 0, sizeof (control));
+    control.id = V4L2_CID_BLUE_BALANCE;
+    control.value = 0;
+    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
+    memset (&control, 0, sizeof (control));
+    control.id = V4L2_CID_AUTOGAIN;
+    control.value = 0;
+    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
+    memset (&control, 0, sizeof (control));
+    control.id = V4L2_CID_HUE_AUTO;
+    control.value = 0;
+    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
+    memset (&control, 0, sizeof (control));
+    control.id =  V4L2_CID_BACKLIGHT_COMPENSATION;
+    control.value = 0;
+    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
+    memset (&control, 0, sizeof (control));
+    control.id =  V4L2_EXPOSURE_AUTO;
+    control.value = 3;
+    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
+}
+
+static void init_device(void)
+{
+        struct v4l2_capability cap;
+        struct v4l2_cropcap cropcap;
+        struct v4l2_crop crop;
+        struct v4l2_format fmt;
+        unsigned int caps;
+        int cached;
+
+        if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
+                if (EINVAL == errno) {
+                        fprintf(stderr, "%s is no V4L2 device\n",
+                                 dev_name);
+                        exit(EXIT_FAILURE);
+                } else {
+                        errno_exit("VIDIOC_QUERYCAP");
+                }
+        }
+
+        caps = cap.capabilities;
+        if (caps & V4L2_CAP_DEVICE_CAPS)
+                caps = cap.device_caps;
+
+        if (caps & V4L2_CAP_VIDEO_CAPTURE) {
+                buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        } else if (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+                buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        } else {
+                fprintf(stderr, "%s is no video capture device\n",
+                         dev_name);
+                exit(EXIT_FAILURE);
+        }
+
+        switch (io) {
+        case IO_METHOD_READ:
+                if (!(caps & V4L2_CAP_READWRITE) || buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+                        fprintf(stderr, "%s does not support read i/o\n",
+                                 dev_name);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
+        case IO_METHOD_MMAP:
+        case IO_METHOD_USERPTR:
+                if (!(caps & V4L2_CAP_STREAMING)) {
+                        fprintf(stderr, "%s does not support streaming i/o\n",
+                                 dev_name);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+        }
+
+
+        /* Select video input, video standard and tune here. */
+
+        /* Only the mode search is cached. Crop and controls are set every time,
+           since another client or a device reset can change them. */
+        cached = load_device_cache(&cap);
+        if (cache_name)
+                fprintf(stderr, "%s %s.\n", cached ? "Using cached format for" : "Probing", dev_name);
+
+        CLEAR(cropcap);
+
+        cropcap.type = buf_type;
+
+        if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
+                crop.type = buf_type;
+                crop.c = cropcap.defrect; /* reset to default */
 
                 if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
                         switch (errno) {
@@ -709,135 +1783,1331 @@ static void init_device(void)
         }
 
 
-        CLEAR(fmt);
-
-        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        if (force_format) {
-                fmt.fmt.pix.width       = 640;
-                fmt.fmt.pix.height      = 480;
-                fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-                fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
+        CLEAR(fmt);
+
+        fmt.type = buf_type;
+        if (detect_width || detect_height) {
+                if (!cached)
+                        negotiate_format(&detect_mode);
+                set_format(&fmt, &detect_mode);
+                set_frame_rate(detect_fps);
+        } else if (force_format) {
+                struct mode m = { 640, 480, find_pix_format(V4L2_PIX_FMT_YUYV) };
+                set_format(&fmt, &m);
+        } else {
+                /* Preserve original settings as set by v4l2-ctl for example */
+                if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt))
+                        errno_exit("VIDIOC_G_FMT");
+        }
+
+        init_io(&fmt);
+
+        disable_auto_controls();
+        if (!cached)
+                save_device_cache(&cap);
+}
+
+static void close_device(void)
+{
+        if (-1 == close(fd))
+                errno_exit("close");
+
+        fd = -1;
+}
+
+static void open_device(void)
+{
+        struct stat st;
+
+        if (-1 == stat(dev_name, &st)) {
+                fprintf(stderr, "Cannot identify '%s': %d, %s\n",
+                         dev_name, errno, strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        if (!S_ISCHR(st.st_mode)) {
+                fprintf(stderr, "%s is no device\n", dev_name);
+                exit(EXIT_FAILURE);
+        }
+
+        fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
+
+        if (-1 == fd) {
+                fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                         dev_name, errno, strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+}
+
+void get_rgb(struct screen_buf* rgb_out){
+    if(rgb_out->length < sizeof(unsigned char) * last_frame.width * last_frame.height * 3){
+        // Only grows for the first frame and the first snapshot, so the old one is just left in the arena.
+        rgb_out->length = sizeof(unsigned char) * last_frame.width * last_frame.height * 3;
+        rgb_out->start = arena_alloc(&work_arena, rgb_out->length);
+    }
+    rgb_out->width = last_frame.width;
+    rgb_out->height = last_frame.height;
+    
+    pix_format->to_rgb(last_frame.width, last_frame.height, frame_planes, plane_stride, rgb_out->start);
+}
+
+void get_jpeg(){
+
+}
+
+/* mask_movment: Build motion_mask from movment_buf, despeckle it if asked
+ * and set active_cells. From here on motion_mask, not movment_buf, says which
+ * cells moved.
+ */
+static void mask_movment(void)
+{
+    mask_from_cells(&motion_mask, movment_buf);
+    if (despeckle) {
+        // Opening: a cell survives only if it has a full 3x3 neighbourhood of
+        // movment, then grows back to the outline of what survived.
+        mask_erode(&motion_mask, &scratch_mask);
+        mask_dilate(&scratch_mask, &motion_mask);
+        mask_from_cells(&scratch_mask, movment_buf);
+        int i;
+        for (i = 0; i < motion_mask.words_per_row * motion_mask.height; i++) {
+            motion_mask.bits[i] &= scratch_mask.bits[i];
+        }
+    }
+    active_cells = mask_count(&motion_mask);
+}
+
+/* write_heatmap: Write heat to peep_heatmap.jpeg, one pixel per cell. Brighter
+ * cells move more often. Noisy cells are red.
+ */
+static void write_heatmap(void)
+{
+    int cells_wide = capture_width / scale;
+    int cells_high = capture_height / scale;
+    int x, y;
+    unsigned char* pixel = heat_rgb;
+
+    for (y = 0; y < cells_high; y++) {
+        const uint64_t* words = noisy_mask.bits + y * noisy_mask.words_per_row;
+        for (x = 0; x < cells_wide; x++) {
+            unsigned char level = heat[y * cells_wide + x] * 255;
+            if ((words[x / 64] >> (x % 64)) & 1) {
+                *pixel++ = 255;
+                *pixel++ = 0;
+                *pixel++ = 0;
+            } else {
+                *pixel++ = level;
+                *pixel++ = level;
+                *pixel++ = level;
+            }
+        }
+    }
+    write_JPEG_file("peep_heatmap.jpeg", heat_rgb, cells_wide, cells_high, 3, 90);
+}
+
+/* suppress_noisy: Fold this frame's movment into the heatmap, then clear the cells
+ * that move most of the time from motion_mask so they trigger no
+ * blobs, crops, events or recording. A cell turns noisy above noisy_percent and
+ * calm again below half of it. Call after mask_movment().
+ * Arguments:
+ *      (struct timespec*)now: When the frame arrived.
+ */
+static void suppress_noisy(struct timespec* now)
+{
+    static long long last_ns = -1;
+    static long long last_write_ns = -1;
+    long long now_time = (long long)now->tv_sec * BILLION + now->tv_nsec;
+    int cells_wide = capture_width / scale;
+    int cells_high = capture_height / scale;
+    int x, y, i, changed = 0;
+
+    if (!noisy_percent) {
+        return;
+    }
+
+    // Weighted by time rather than frames, so idle spells and --batch gaps count.
+    float rate = (last_ns < 0 || now_time < last_ns) ? 0 : (float)(now_time - last_ns) / ((float)HEAT_SECONDS * BILLION);
+    if (rate > 1) {
+        rate = 1;
+    }
+    last_ns = now_time;
+    for (y = 0; y < cells_high; y++) {
+        const uint64_t* words = motion_mask.bits + y * motion_mask.words_per_row;
+        float* row = heat + y * cells_wide;
+        for (x = 0; x < cells_wide; x++) {
+            row[x] += ((float)((words[x / 64] >> (x % 64)) & 1) - row[x]) * rate;
+        }
+    }
+
+    float on = noisy_percent / 100.0f;
+    float off = on / 2;
+    for (y = 0; y < cells_high; y++) {
+        uint64_t* words = noisy_mask.bits + y * noisy_mask.words_per_row;
+        for (x = 0; x < cells_wide; x++) {
+            uint64_t bit = 1ULL << (x % 64);
+            float h = heat[y * cells_wide + x];
+            if (!(words[x / 64] & bit) && h > on) {
+                words[x / 64] |= bit;
+                noisy_cells++;
+                changed = 1;
+            } else if ((words[x / 64] & bit) && h < off) {
+                words[x / 64] &= ~bit;
+                noisy_cells--;
+                changed = 1;
+            }
+        }
+    }
+    if (changed) {
+        printf("noisy %li.%09li cells=%i\n", (long)now->tv_sec, now->tv_nsec, noisy_cells);
+        fflush(stdout);
+    }
+
+    if (noisy_cells) {
+        for (i = 0; i < motion_mask.words_per_row * motion_mask.height; i++) {
+            motion_mask.bits[i] &= ~noisy_mask.bits[i];
+        }
+        active_cells = mask_count(&motion_mask);
+    }
+
+    // A replay leaves nothing behind in the working directory.
+    if (!replay_name && (last_write_ns < 0 || now_time - last_write_ns >= (long long)HEATMAP_SECONDS * BILLION)) {
+        write_heatmap();
+        last_write_ns = now_time;
+    }
+}
+
+/* overlap: Whether two crops share any pixels. */
+static int overlap(const struct crop* a, const struct crop* b)
+{
+    return a->x < b->x + b->width && b->x < a->x + a->width && a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+/* add_crop: Add the pixels under cells x0,y0 to x1,y1 (inclusive) and a cell all
+ * round to crops[]. The edges go out to whole MCUs, and crops that then overlap
+ * are merged. Past MAX_CROPS the rest are merged into the last one.
+ */
+static void add_crop(int x0, int y0, int x1, int y1)
+{
+    struct crop c;
+    int i, right, bottom;
+
+    c.x = ((x0 ? x0 - 1 : 0) * scale) & ~(CROP_ALIGN - 1);
+    c.y = ((y0 ? y0 - 1 : 0) * scale) & ~(CROP_ALIGN - 1);
+    right = ((x1 + 2) * scale + CROP_ALIGN - 1) & ~(CROP_ALIGN - 1);
+    bottom = ((y1 + 2) * scale + CROP_ALIGN - 1) & ~(CROP_ALIGN - 1);
+    c.width = ((right > capture_width) ? capture_width : right) - c.x;
+    c.height = ((bottom > capture_height) ? capture_height : bottom) - c.y;
+
+    for (;;) {
+        for (i = 0; i < n_crops && !overlap(&c, &crops[i]); i++);
+        if (i == n_crops) {
+            if (n_crops < MAX_CROPS) {
+                break;
+            }
+            i = n_crops - 1;
+        }
+        // Grow c over crops[i] and look again, it may overlap others now.
+        right = (c.x + c.width > crops[i].x + crops[i].width) ? c.x + c.width : crops[i].x + crops[i].width;
+        bottom = (c.y + c.height > crops[i].y + crops[i].height) ? c.y + c.height : crops[i].y + crops[i].height;
+        c.x = (c.x < crops[i].x) ? c.x : crops[i].x;
+        c.y = (c.y < crops[i].y) ? c.y : crops[i].y;
+        c.width = right - c.x;
+        c.height = bottom - c.y;
+        crops[i] = crops[--n_crops];
+    }
+    crops[n_crops++] = c;
+}
+
+/* take_cell: Clear cell x, y of blob_todo. Returns 1 if it was set. */
+static inline int take_cell(int x, int y)
+{
+    uint64_t* word = blob_todo.bits + y * blob_todo.words_per_row + x / 64;
+    uint64_t bit = 1ULL << (x % 64);
+
+    if (!(*word & bit)) {
+        return 0;
+    }
+    *word &= ~bit;
+    return 1;
+}
+
+/* find_blobs: Group the cells of motion_mask into 4-connected blobs.
+ * Sets blob_count and peak_blob, and crops[] in crop_mode. Call mask_movment() first.
+ */
+static void find_blobs(void)
+{
+    int cells_wide = capture_width / scale;
+    int cells_high = capture_height / scale;
+    int row, w;
+
+    blob_count = 0;
+    peak_blob = 0;
+    n_crops = 0;
+    if (!active_cells) {
+        return;
+    }
+    memcpy(blob_todo.bits, motion_mask.bits, sizeof(uint64_t) * blob_todo.words_per_row * cells_high);
+
+    for (row = 0; row < cells_high; row++) {
+        uint64_t* words = blob_todo.bits + row * blob_todo.words_per_row;
+        for (w = 0; w < blob_todo.words_per_row; w++) {
+            // Blobs take cells from this word as they grow, so reread it each time.
+            while (words[w]) {
+                int i = row * cells_wide + w * 64 + __builtin_ctzll(words[w]);
+                int size = 0;
+                int top = 0;
+                int min_x = i % cells_wide, max_x = min_x;
+                int min_y = row, max_y = row;
+                take_cell(min_x, row);
+                blob_stack[top++] = i;
+                while (top) {
+                    int cell = blob_stack[--top];
+                    int x = cell % cells_wide;
+                    int y = cell / cells_wide;
+                    size++;
+                    min_x = (x < min_x) ? x : min_x;
+                    max_x = (x > max_x) ? x : max_x;
+                    min_y = (y < min_y) ? y : min_y;
+                    max_y = (y > max_y) ? y : max_y;
+                    if (x > 0 && take_cell(x - 1, y)) {
+                        blob_stack[top++] = cell - 1;
+                    }
+                    if (x < cells_wide - 1 && take_cell(x + 1, y)) {
+                        blob_stack[top++] = cell + 1;
+                    }
+                    if (y > 0 && take_cell(x, y - 1)) {
+                        blob_stack[top++] = cell - cells_wide;
+                    }
+                    if (y < cells_high - 1 && take_cell(x, y + 1)) {
+                        blob_stack[top++] = cell + cells_wide;
+                    }
+                }
+                blob_count++;
+                if (size > peak_blob) {
+                    peak_blob = size;
+                }
+                if (crop_mode) {
+                    add_crop(min_x, min_y, max_x, max_y);
+                }
+            }
+        }
+    }
+}
+
+/* take_snapshot: Briefly switch the device to its largest mode, save one
+ * frame to peep_snapshot.jpeg, then go back to the detection mode.
+ * Arguments:
+ *      (struct screen_buf*)snap_frame: RGB buffer for the full resolution frame.
+ */
+static void take_snapshot(struct screen_buf* snap_frame)
+{
+    struct v4l2_format fmt;
+    struct mode current = { capture_width, capture_height, pix_format };
+    int switch_mode = full_mode.format &&
+        (full_mode.width > current.width || full_mode.height > current.height);
+
+    if (switch_mode) {
+        stop_capturing();
+        uninit_device();
+        set_format(&fmt, &full_mode);
+        init_io(&fmt);
+        start_capturing();
+        mainloop();
+    }
+
+    get_rgb(snap_frame);
+    stage_begin(&snapshot_stage);
+    write_JPEG_file_sliced("peep_snapshot.jpeg", snap_frame->start, snap_frame->width, snap_frame->height, 3,
+                           jpeg_quality, jpeg_slices);
+    stage_end(&snapshot_stage);
+
+    if (switch_mode) {
+        stop_capturing();
+        uninit_device();
+        set_format(&fmt, &current);
+        set_frame_rate(detect_fps);
+        init_io(&fmt);
+        start_capturing();
+    }
+}
+
+/* Write a buffer to a file, replacing it. */
+static void save_file(const char* filename, const unsigned char* data, unsigned long size)
+{
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "can't open %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    fwrite(data, 1, size, fp);
+    fclose(fp);
+}
+
+/* open_outputs: Open the motion index and recording segment, as requested. */
+static void open_outputs(void)
+{
+    if (index_name) {
+        motion_index_open(&motion_index, index_name);
+    }
+    if (record_name) {
+        record_fp = fopen(record_name, "ab");
+        if (!record_fp) {
+            fprintf(stderr, "Cannot open '%s': %d, %s\n", record_name, errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        record_size = ftell(record_fp);
+    }
+}
+
+static void close_outputs(void)
+{
+    if (index_name) {
+        motion_index_close(&motion_index);
+    }
+    if (record_fp) {
+        fclose(record_fp);
+    }
+}
+
+/* set_realtime: Pin the capture thread to capture_cpu, run it under SCHED_FIFO
+ * at rt_priority and lock all current and future memory, as requested.
+ */
+static void set_realtime(void)
+{
+    if (capture_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(capture_cpu, &cpus);
+        if (-1 == sched_setaffinity(0, sizeof(cpus), &cpus))
+            errno_exit("sched_setaffinity");
+    }
+
+    if (rt_priority) {
+        struct sched_param param;
+        CLEAR(param);
+        param.sched_priority = rt_priority;
+        if (-1 == sched_setscheduler(0, SCHED_FIFO, &param))
+            errno_exit("sched_setscheduler");
+    }
+
+    if (lock_memory) {
+        if (-1 == mlockall(MCL_CURRENT | MCL_FUTURE))
+            errno_exit("mlockall");
+    }
+}
+
+/* startup_phase: Print how long the startup phase that just ended took, and the
+ * time since main() started.
+ */
+static void startup_phase(const char* name)
+{
+    static long long last_ns;
+    long long now = now_ns();
+
+    if (!last_ns) {
+        last_ns = startup_ns;
+    }
+    fprintf(stderr, "startup %-16s %8.1fms  total %8.1fms\n", name, (double)(now - last_ns) / 1000000,
+            (double)(now - startup_ns) / 1000000);
+    last_ns = now;
+}
+
+/* prefault: Touch every page the capture path uses so the first frames do not
+ * stall on page faults.
+ * Arguments:
+ *      (struct screen_buf*)rgb_frame: RGB buffer to size and fault in now.
+ */
+static void prefault(struct screen_buf* rgb_frame)
+{
+    volatile unsigned char sink;
+    unsigned int i;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t cells = capture_width * capture_height / (scale * scale);
+
+    for (i = 0; i < n_buffers; ++i) {
+        unsigned int j;
+        for (j = 0; j < n_planes; ++j) {
+            size_t offset;
+            for (offset = 0; offset < buffers[i].plane_length[j]; offset += page) {
+                sink = ((unsigned char*)buffers[i].planes[j])[offset];
+            }
+        }
+    }
+    (void)sink;
+
+    memset(average_buf, 0, sizeof(float) * 3 * cells);
+    memset(average_char_buf, 0, sizeof(unsigned char) * 3 * cells);
+    memset(movment_buf, 0, cells);
+    memset(blob_stack, 0, sizeof(int) * cells);
+    if (luma_buf) {
+        memset(luma_buf, 0, capture_width * capture_height);
+        memset(last_luma_buf, 0, capture_width * capture_height);
+    }
+
+    last_frame.width = capture_width;
+    last_frame.height = capture_height;
+    rgb_frame->length = sizeof(unsigned char) * capture_width * capture_height * 3;
+    rgb_frame->start = arena_alloc(&work_arena, rgb_frame->length);
+    // Already zero, but this faults the pages in now.
+    memset(rgb_frame->start, 0, rgb_frame->length);
+}
+
+static void set_mode(enum duty_mode mode, long long now)
+{
+    mode_ns[duty_mode] += now - mode_since_ns;
+    mode_since_ns = now;
+    duty_mode = mode;
+
+    if (mode == MODE_IDLE) {
+        fprintf(stderr, "No movment for %is. Going idle at %i fps.\n", idle_after, idle_fps);
+        keep_luma(frame_luma(idle_luma_buf), &idle_luma_buf, &idle_last_luma_buf);
+    } else {
+        fprintf(stderr, "Movment. Back to full rate.\n");
+    }
+}
+
+/* idle_movment: Cheap check of last_frame for movment while idle.
+ * Compares the Y plane with the previous idle frame over idle_scale blocks.
+ * Returns:
+ *      (int): 1 if any block changed by more than bright_thresh. Otherwise 0.
+ */
+static int idle_movment(void)
+{
+    int i, cells = capture_width * capture_height / (idle_scale * idle_scale);
+    const unsigned char *luma = frame_luma(idle_luma_buf);
+
+    block_sad(idle_last_luma_buf, luma, capture_width, capture_height, idle_scale,
+              idle_movment_buf, bright_thresh);
+    keep_luma(luma, &idle_luma_buf, &idle_last_luma_buf);
+
+    for (i = 0; i < cells; i++) {
+        if (idle_movment_buf[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Seconds between processed frames in the current mode. */
+static double frame_interval(void)
+{
+    return (duty_mode == MODE_IDLE) ? 1.0 / idle_fps : 0.1;
+}
+
+static void report_modes(FILE* fp, long long now)
+{
+    long long active = mode_ns[MODE_ACTIVE];
+    long long idle = mode_ns[MODE_IDLE];
+
+    if (duty_mode == MODE_ACTIVE) {
+        active += now - mode_since_ns;
+    } else {
+        idle += now - mode_since_ns;
+    }
+    fprintf(fp, "mode=%s active=%.1fs idle=%.1fs duplicates=%lli\n", (duty_mode == MODE_IDLE) ? "idle" : "active",
+            (double)active / BILLION, (double)idle / BILLION, duplicate_frames);
+}
+
+/* frame_plane: Memory plane i of last_frame.
+ * Arguments:
+ *      (int)i:          Plane, 0 to pix_format->mem_planes - 1.
+ *      (size_t*)length: Set to the bytes of image data in the plane.
+ */
+static const unsigned char* frame_plane(int i, size_t* length)
+{
+    // Padding included. It is either constant or as new as the frame.
+    *length = frame_plane_bytes[i];
+    return frame_planes[i];
+}
+
+/* hash_frame: hash64() of every plane of last_frame. */
+static uint64_t hash_frame(void)
+{
+    uint64_t hash = 0;
+    int i;
+
+    for (i = 0; i < pix_format->mem_planes; i++) {
+        size_t length;
+        const unsigned char* plane = frame_plane(i, &length);
+        hash = hash64(plane, length, hash);
+    }
+    return hash;
+}
+
+/* sha256_frame: SHA-256 of every plane of last_frame as hex.
+ * Arguments:
+ *      (char*)hex: Buffer of at least 65 bytes.
+ */
+static void sha256_frame(char* hex)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len, i;
+    int plane;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+    if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+        fprintf(stderr, "SHA-256 unavailable\n");
+        exit(EXIT_FAILURE);
+    }
+    for (plane = 0; plane < pix_format->mem_planes; plane++) {
+        size_t length;
+        const unsigned char* data = frame_plane(plane, &length);
+        EVP_DigestUpdate(ctx, data, length);
+    }
+    EVP_DigestFinal_ex(ctx, digest, &digest_len);
+    EVP_MD_CTX_free(ctx);
+
+    for (i = 0; i < digest_len; i++) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+}
+
+/* same_frame: Check last_frame against the previous one and track stale feeds.
+ * Arguments:
+ *      (struct timespec*)now: When the frame arrived.
+ * Returns:
+ *      (int): 1 if last_frame is identical to the previous frame. Otherwise 0.
+ */
+static int same_frame(struct timespec* now)
+{
+    uint64_t hash = hash_frame();
+
+    if (!first_run && hash == frame_hash) {
+        repeats++;
+        duplicate_frames++;
+        if (stale_after && repeats == stale_after) {
+            printf("stale %li.%09li frames=%i hash=%016llx\n",
+                   (long)now->tv_sec, now->tv_nsec, repeats, (unsigned long long)hash);
+            fflush(stdout);
+        }
+        return 1;
+    }
+
+    if (stale_after && repeats >= stale_after) {
+        printf("live %li.%09li frames=%i hash=%016llx\n",
+               (long)now->tv_sec, now->tv_nsec, repeats, (unsigned long long)hash);
+        fflush(stdout);
+    }
+    repeats = 0;
+    frame_hash = hash;
+    return 0;
+}
+
+/* encode_renditions: Write every rendition that is due this frame. Pyramid levels
+ * are only built as deep as the deepest of those, each from the one above it.
+ * Arguments:
+ *      (struct screen_buf*)rgb_frame: Converted frame. Level 0 of the pyramid.
+ *      (long long)now_time:           Capture time of the frame in ns.
+ *      (unsigned char**)full:         Set to the first full size Jpeg written, for the caller
+ *                                     to free, or NULL if there wasn't one.
+ * Returns: Size of *full.
+ */
+static unsigned long encode_renditions(struct screen_buf* rgb_frame, long long now_time, unsigned char** full)
+{
+    int i;
+    int built = 0;                      // Levels of pyramid[] that hold this frame.
+    unsigned long full_size = 0;
+
+    *full = NULL;
+    for (i = 0; i < n_renditions; i++) {
+        struct rendition* r = &renditions[i];
+        if (r->motion_only && !active_cells) {
+            continue;
+        }
+        if (r->last_ns >= 0 && now_time - r->last_ns < (long long)(r->interval * BILLION)) {
+            continue;
+        }
+        for (; built < r->level; built++) {
+            struct screen_buf* from = built ? &pyramid[built] : rgb_frame;
+            rgb_half(from->start, from->width, from->height, pyramid[built + 1].start);
+        }
+
+        struct screen_buf* src = r->level ? &pyramid[r->level] : rgb_frame;
+        unsigned char* jpeg;
+        // Thumbnails are too small to be worth splitting.
+        unsigned long jpeg_size = compress_JPEG_mem(&jpeg, src->start, src->width, src->height, 3,
+                                                    r->quality, r->level ? 1 : jpeg_slices);
+        if (!replay_name) {
+            save_file(r->filename, jpeg, jpeg_size);
+        }
+        r->last_ns = now_time;
+        if (!r->level && !*full) {
+            *full = jpeg;
+            full_size = jpeg_size;
+        } else {
+            free(jpeg);
+        }
+    }
+    return full_size;
+}
+
+static void compress_crop(void* arg, int i)
+{
+    struct screen_buf* rgb_frame = arg;
+    struct crop* c = &crops[i];
+    char comment[64];
+
+    // Where the crop came from, to put it back on a context frame.
+    snprintf(comment, sizeof(comment), "peep crop %i,%i %ix%i of %ix%i", c->x, c->y, c->width, c->height,
+             rgb_frame->width, rgb_frame->height);
+    c->size = compress_JPEG_crop(&c->mem, rgb_frame->start, rgb_frame->width, c->x, c->y, c->width, c->height,
+                                 jpeg_quality, comment);
+}
+
+/* encode_crops: Compress crops[] on the worker pool, and a low quality full frame
+ * if context_interval has passed since the last one.
+ * Arguments:
+ *      (struct screen_buf*)rgb_frame: Converted frame.
+ *      (long long)now_time:           Capture time of the frame in ns.
+ *      (unsigned char**)context:      Set to the full frame, for the caller to free, or NULL.
+ * Returns: Size of *context.
+ */
+static unsigned long encode_crops(struct screen_buf* rgb_frame, long long now_time, unsigned char** context)
+{
+    static long long last_context = -1;
+    unsigned long context_size = 0;
+
+    pool_run(compress_crop, rgb_frame, n_crops);
+    *context = NULL;
+    if (last_context < 0 || now_time - last_context >= (long long)context_interval * BILLION) {
+        context_size = compress_JPEG_mem(context, rgb_frame->start, rgb_frame->width, rgb_frame->height, 3,
+                                         CONTEXT_QUALITY, jpeg_slices);
+        last_context = now_time;
+    }
+    return context_size;
+}
+
+static void record_jpeg(const unsigned char* jpeg, unsigned long size)
+{
+    if (fwrite(jpeg, 1, size, record_fp) != size)
+        errno_exit("fwrite");
+    record_size += size;
+}
+
+/* record_crops: Append the context frame, if there is one, then crops[] to the
+ * recording, and free them.
+ */
+static void record_crops(unsigned char* context, unsigned long context_size, struct screen_buf* rgb_frame)
+{
+    int i;
+
+    // Context first, so a reader has the frame before the crops that go on it.
+    if (context) {
+        record_jpeg(context, context_size);
+        context_bytes += context_size;
+        free(context);
+    }
+    for (i = 0; i < n_crops; i++) {
+        record_jpeg(crops[i].mem, crops[i].size);
+        crop_bytes += crops[i].size;
+        crop_pixels += (unsigned long long)crops[i].width * crops[i].height;
+        free(crops[i].mem);
+    }
+    crop_count += n_crops;
+    frame_pixels += (unsigned long long)rgb_frame->width * rgb_frame->height;
+}
+
+static void report_crops(FILE* fp)
+{
+    if (!crop_mode) {
+        return;
+    }
+    fprintf(fp, "crops=%lli area=%.1f%% crop_bytes=%llu context_bytes=%llu\n", crop_count,
+            frame_pixels ? 100.0 * crop_pixels / frame_pixels : 0.0, crop_bytes, context_bytes);
+}
+
+/* process_frame: Run the newest frame through conversion, detection and output.
+ * Arguments:
+ *      (struct screen_buf*)rgb_frame:      RGB buffer for the converted frame.
+ *      (struct screen_buf*)snapshot_frame: RGB buffer for full resolution snapshots.
+ *      (struct timespec*)now:              Capture time of the frame.
+ * Returns:
+ *      (int): 1 if the frame went through detection. 0 if it was a duplicate, or idle.
+ */
+static int process_frame(struct screen_buf* rgb_frame, struct screen_buf* snapshot_frame, struct timespec* now)
+{
+    static time_t last_snapshot = 0;
+    long long now_time = (long long)now->tv_sec * BILLION + now->tv_nsec;
+
+    if (first_run) {
+        mode_since_ns = now_time;
+        last_movment_ns = now_time;
+    }
+    if (same_frame(now)) {
+        // Nothing new to convert, detect or save. A frozen feed still goes idle.
+        if (duty_mode == MODE_ACTIVE && idle_after &&
+                now_time - last_movment_ns >= (long long)idle_after * BILLION) {
+            set_mode(MODE_IDLE, now_time);
+        }
+        return 0;
+    }
+    if (duty_mode == MODE_IDLE) {
+        if (!idle_movment()) {
+            return 0;
+        }
+        // Carry on with this frame at full rate.
+        set_mode(MODE_ACTIVE, now_time);
+    }
+
+    stage_begin(&convert_stage);
+    //YUV422toRGB888(capture_width, capture_height, last_frame.start, rgb_buf);
+    get_rgb(rgb_frame);
+    stage_end(&convert_stage);
+
+    stage_begin(&detect_stage);
+    //update_movment(rgb_buf);
+    switch (detector) {
+        case DETECTOR_AVERAGE:
+            update_movment(rgb_frame->start);
+            break;
+        case DETECTOR_SAD:
+            update_movment_sad();
+            break;
+        case DETECTOR_GAUSS:
+            update_movment_gauss(rgb_frame->start);
+            break;
+    }
+    mask_movment();
+    suppress_noisy(now);
+    check_flood(rgb_frame->start, now);
+    find_blobs();
+    stage_end(&detect_stage);
+    stage_add(&latency_stage, now_ns() - last_frame_ns);
+
+    if (!replay_name) {
+        display_image(movment_buf);
+    }
+
+    stage_begin(&encode_stage);
+    unsigned char* jpeg;
+    unsigned long jpeg_size = encode_renditions(rgb_frame, now_time, &jpeg);
+    unsigned char* context = NULL;
+    unsigned long context_size = 0;
+    if (record_fp && active_cells && crop_mode) {
+        context_size = encode_crops(rgb_frame, now_time, &context);
+    } else if (record_fp && active_cells && !jpeg) {
+        // No full size rendition this frame, so the recording needs its own.
+        jpeg_size = compress_JPEG_mem(&jpeg, rgb_frame->start, rgb_frame->width, rgb_frame->height, 3,
+                                      jpeg_quality, jpeg_slices);
+    }
+    stage_end(&encode_stage);
+
+    if (index_name) {
+        motion_index_add(&motion_index, now->tv_sec, active_cells, peak_blob, record_size);
+    }
+    if (record_fp && active_cells) {
+        if (crop_mode) {
+            record_crops(context, context_size, rgb_frame);
+        } else {
+            record_jpeg(jpeg, jpeg_size);
+        }
+        fflush(record_fp);
+    }
+    free(jpeg);
+
+    if (active_cells) {
+        char sha[EVP_MAX_MD_SIZE * 2 + 1] = "";
+        if (audit_sha256) {
+            sha256_frame(sha);
+        }
+        printf("event %li.%09li cells=%i blobs=%i peak=%i hash=%016llx%s%s\n",
+               (long)now->tv_sec, now->tv_nsec, active_cells, blob_count, peak_blob,
+               (unsigned long long)frame_hash, audit_sha256 ? " sha256=" : "", sha);
+        fflush(stdout);
+    }
+
+    if (snapshot_interval && !first_run && now->tv_sec - last_snapshot >= snapshot_interval &&
+            active_cells) {
+        take_snapshot(snapshot_frame);
+        last_snapshot = now->tv_sec;
+    }
+
+    //float_buf_to_char_buf(average_buf, average_char_buf, capture_width / scale, capture_height / scale, 3);
+    //write_JPEG_file("peep_average.jpeg", average_char_buf, capture_width / scale, capture_height / scale, 3);
+
+    //write_JPEG_file("peep_movment.jpeg", movment_buf, capture_width / scale, capture_height / scale, 1);
+    if (export_mask) {
+        save_file("peep_movment.rle", rle_buf, mask_rle(&motion_mask, rle_buf));
+    }
+
+    if (active_cells) {
+        last_movment_ns = now_time;
+    } else if (idle_after && now_time - last_movment_ns >= (long long)idle_after * BILLION) {
+        set_mode(MODE_IDLE, now_time);
+    }
+
+    first_run = 0;
+    return 1;
+}
+
+/* check_converter: Largest difference between YUV422toRGB888() output and the
+ * double precision formula, over one frame.
+ * Arguments:
+ *      (unsigned char*)yuyv: Source frame.
+ *      (unsigned char*)rgb:  YUV422toRGB888() output for that frame.
+ */
+static int check_converter(const unsigned char* yuyv, const unsigned char* rgb)
+{
+    int i, c, worst = 0;
+
+    for (i = 0; i < capture_width * capture_height; i++) {
+        double y = yuyv[i * 2];
+        double u = yuyv[(i & ~1) * 2 + 1] - 128.0;
+        double v = yuyv[(i & ~1) * 2 + 3] - 128.0;
+        double ref[3];
+        ref[R] = y + 1.402 * v;
+        ref[G] = y - 0.344 * u - 0.714 * v;
+        ref[B] = y + 1.772 * u;
+        for (c = 0; c < 3; c++) {
+            int expect = CLIP(ref[c]);
+            int diff = abs(expect - rgb[i * 3 + c]);
+            if (diff > worst) {
+                worst = diff;
+            }
+        }
+    }
+    return worst;
+}
+
+/* A Jpeg from batch_name and, once decoded, its pixels. */
+struct batch_file {
+    char*               name;
+    struct timespec     mtime;
+    unsigned char*      rgb;                    // NULL if it would not decode.
+    int                 width;
+    int                 height;
+};
+
+struct batch_job {
+    struct batch_file*  files;
+    int                 denom;                  // IDCT scale.
+};
+
+static int is_jpeg(const struct dirent* entry)
+{
+    const char* ext = strrchr(entry->d_name, '.');
+    return ext && (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg"));
+}
+
+/* Oldest first. Name breaks ties so the order is the same every run. */
+static int by_mtime(const void* a, const void* b)
+{
+    const struct batch_file* fa = a;
+    const struct batch_file* fb = b;
+
+    if (fa->mtime.tv_sec != fb->mtime.tv_sec) {
+        return (fa->mtime.tv_sec < fb->mtime.tv_sec) ? -1 : 1;
+    }
+    if (fa->mtime.tv_nsec != fb->mtime.tv_nsec) {
+        return (fa->mtime.tv_nsec < fb->mtime.tv_nsec) ? -1 : 1;
+    }
+    return strcmp(fa->name, fb->name);
+}
+
+static void decode_batch_file(void* arg, int i)
+{
+    struct batch_job* job = arg;
+    struct batch_file* file = &job->files[i];
+    unsigned long size;
+
+    file->rgb = NULL;
+    const unsigned char* mem = jpeg_file_map(file->name, &size);
+    if (mem) {
+        file->rgb = decompress_JPEG_mem(mem, size, job->denom, &file->width, &file->height);
+        jpeg_file_unmap(mem, size);
+    }
+}
+
+static void free_batch_files(struct batch_file* files, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        free(files[i].name);
+    }
+    free(files);
+}
+
+/* batch: Run every Jpeg in batch_name through the detector, oldest first.
+ * Files are decoded in parallel on the worker pool, a window at a time, and
+ * scaled down in the IDCT by as much as scale allows.
+ * Returns:
+ *      (int): EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int batch(void)
+{
+    struct dirent** names;
+    struct batch_job job;
+    struct stat st;
+    int n, i, width, height, frames = 0;
+    unsigned long size;
+
+    n = scandir(batch_name, &names, is_jpeg, alphasort);
+    if (n < 0) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n", batch_name, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (!n) {
+        fprintf(stderr, "No Jpegs in '%s'\n", batch_name);
+        return EXIT_FAILURE;
+    }
+
+    job.files = calloc(n, sizeof(struct batch_file));
+    if (!job.files) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < n; i++) {
+        struct batch_file* file = &job.files[i];
+        file->name = malloc(strlen(batch_name) + strlen(names[i]->d_name) + 2);
+        if (!file->name) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(file->name, "%s/%s", batch_name, names[i]->d_name);
+        if (stat(file->name, &st) == 0) {
+            file->mtime = st.st_mtim;
+        }
+        free(names[i]);
+    }
+    free(names);
+    qsort(job.files, n, sizeof(struct batch_file), by_mtime);
+
+    // The first file sets the frame size for the whole batch.
+    const unsigned char* mem = jpeg_file_map(job.files[0].name, &size);
+    int unreadable = !mem || read_JPEG_size(mem, size, &width, &height) < 0;
+    if (mem) {
+        jpeg_file_unmap(mem, size);
+    }
+    if (unreadable) {
+        fprintf(stderr, "Cannot read '%s'\n", job.files[0].name);
+        free_batch_files(job.files, n);
+        return EXIT_FAILURE;
+    }
+
+    // update_movment() only looks at one pixel per scale x scale block, so
+    // decode at 1/denom and sample every scale / denom pixels instead.
+    for (job.denom = 8; job.denom > 1; job.denom /= 2) {
+        if (scale % job.denom == 0) {
+            break;
+        }
+    }
+    scale /= job.denom;
+    capture_width = (width + job.denom - 1) / job.denom;
+    capture_height = (height + job.denom - 1) / job.denom;
+    init_buf();
+
+    int window = pool_size() * 4;
+    long long begin = now_ns();
+    for (i = 0; i < n; i += window) {
+        int count = (n - i < window) ? n - i : window;
+        int j;
+
+        stage_begin(&convert_stage);
+        pool_run(decode_batch_file, &(struct batch_job){ job.files + i, job.denom }, count);
+        stage_end(&convert_stage);
+
+        for (j = i; j < i + count; j++) {
+            struct batch_file* file = &job.files[j];
+            if (!file->rgb) {
+                fprintf(stderr, "%s: skipped, cannot decode\n", file->name);
+                continue;
+            }
+            if (file->width != capture_width || file->height != capture_height) {
+                fprintf(stderr, "%s: skipped, not %ix%i\n", file->name, width, height);
+                free(file->rgb);
+                continue;
+            }
+
+            stage_begin(&detect_stage);
+            if (detector == DETECTOR_GAUSS) {
+                update_movment_gauss(file->rgb);
+            } else {
+                update_movment(file->rgb);
+            }
+            mask_movment();
+            suppress_noisy(&file->mtime);
+            check_flood(file->rgb, &file->mtime);
+            find_blobs();
+            stage_end(&detect_stage);
+            free(file->rgb);
+
+            if (active_cells) {
+                printf("event %li.%09li cells=%i blobs=%i peak=%i file=%s\n",
+                       (long)file->mtime.tv_sec, file->mtime.tv_nsec, active_cells, blob_count, peak_blob,
+                       file->name);
+            }
+            first_run = 0;
+            frames++;
+        }
+    }
+    double seconds = (double)(now_ns() - begin) / BILLION;
+    fflush(stdout);
+
+    fprintf(stderr, "batch: %i of %i frames of %ix%i decoded at 1/%i in %.2fs, %.1f frames/s\n",
+            frames, n, width, height, job.denom, seconds, seconds > 0 ? frames / seconds : 0.0);
+    stage_report(stderr, &convert_stage);
+    stage_report(stderr, &detect_stage);
+    arena_report(stderr, &work_arena);
+
+    uninit_buf();
+    free_batch_files(job.files, n);
+    return EXIT_SUCCESS;
+}
+
+/* bench: Time the specialised update_movment() kernel for every scale against
+ * update_movment_modulo(), on capture_width x capture_height noise. Both must
+ * give the same background and movment.
+ * Returns:
+ *      (int): EXIT_SUCCESS or EXIT_FAILURE if any kernel disagrees.
+ */
+static int bench(void)
+{
+    const int iterations = 200;
+    size_t size = capture_width * capture_height * 3;
+    unsigned char* frames[2] = { malloc(size), malloc(size) };
+    int shift, i, k, failed = 0;
+    size_t j;
+
+    if (!frames[0] || !frames[1]) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (j = 0; j < size; j++) {
+        frames[0][j] = rand();
+        frames[1][j] = rand();
+    }
+
+    fprintf(stderr, "update_movment() on %ix%i, %i frames per run\n", capture_width, capture_height, iterations);
+    for (shift = 0; shift < 8; shift++) {
+        scale = 1 << shift;
+        if (capture_width < scale || capture_height < scale) {
+            break;
+        }
+        size_t cells = (capture_width / scale) * (capture_height / scale);
+        long long took[2];
+        unsigned char* result[2];
+
+        for (k = 0; k < 2; k++) {
+            void (*kernel)(unsigned char*) = k ? movment_kernels[shift] : update_movment_modulo;
+            init_buf();
+            first_run = 1;
+            kernel(frames[0]);
+            first_run = 0;
+
+            long long begin = now_ns();
+            for (i = 0; i < iterations; i++) {
+                kernel(frames[i & 1]);
+            }
+            took[k] = now_ns() - begin;
+
+            result[k] = malloc(cells * (1 + 3 * sizeof(float)));
+            if (!result[k]) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(result[k], movment_buf, cells);
+            memcpy(result[k] + cells, average_buf, 3 * sizeof(float) * cells);
+            uninit_buf();
+        }
+
+        int same = !memcmp(result[0], result[1], cells * (1 + 3 * sizeof(float)));
+        fprintf(stderr, "scale %-4i modulo %10lli ns/frame  specialised %10lli ns/frame  x%.2f%s\n", scale,
+                took[0] / iterations, took[1] / iterations, took[1] ? (double)took[0] / took[1] : 0.0,
+                same ? "" : "  DIFFERENT OUTPUT");
+        failed |= !same;
+        free(result[0]);
+        free(result[1]);
+    }
+
+    free(frames[0]);
+    free(frames[1]);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* replay: Run every frame of replay_name through process_frame().
+ * If golden_name exists the detector output of each frame (movment_buf,
+ * motion_mask and the blob counts) must match it, otherwise it is written.
+ * Stage budgets are checked at the end. Renditions are still encoded, for the
+ * encode stage, but not saved.
+ * Returns:
+ *      (int): EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int replay(struct screen_buf* rgb_frame, struct screen_buf* snapshot_frame)
+{
+    size_t frame_size = capture_width * capture_height * 2;
+    size_t cells = capture_width * capture_height / (scale * scale);
+    size_t mask_bytes = sizeof(uint64_t) * ((capture_width / scale + 63) / 64) * (capture_height / scale);
+    size_t golden_size = cells + mask_bytes + 2 * sizeof(int);
+    unsigned char* frame = malloc(frame_size);
+    unsigned char* result = malloc(golden_size);
+    unsigned char* expected = malloc(golden_size);
+    int frame_num = 0, failed = 0, recording = 0, worst_error = 0;
+    unsigned int i;
+    FILE* golden_fp = NULL;
+
+    if (!frame || !result || !expected) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE* replay_fp = fopen(replay_name, "rb");
+    if (!replay_fp) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n", replay_name, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (golden_name) {
+        golden_fp = fopen(golden_name, "rb");
+        if (!golden_fp) {
+            golden_fp = fopen(golden_name, "wb");
+            recording = 1;
+        }
+        if (!golden_fp) {
+            fprintf(stderr, "Cannot open '%s': %d, %s\n", golden_name, errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Clips are unpadded YUYV.
+    unsigned int stride = capture_width * 2;
+    unsigned int bytes = frame_size;
+    set_plane_layout(&stride, &bytes);
+
+    init_buf();
+    while (fread(frame, frame_size, 1, replay_fp) == 1) {
+        // Pretend frames arrive at the rate main() processes them.
+        struct timespec now = { frame_num / 10, (frame_num % 10) * (BILLION / 10) };
 
-                if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
-                        errno_exit("VIDIOC_S_FMT");
+        void* planes[1] = { frame };
+        process_image(planes, NULL, frame_size);
+        process_frame(rgb_frame, snapshot_frame, &now);
 
-                /* Note VIDIOC_S_FMT may change width and height. */
-        } else {
-                /* Preserve original settings as set by v4l2-ctl for example */
-                if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt))
-                        errno_exit("VIDIOC_G_FMT");
+        int error = check_converter(frame, rgb_frame->start);
+        if (error > worst_error) {
+            worst_error = error;
         }
 
-        /* Buggy driver paranoia. */
-        min = fmt.fmt.pix.width * 2;
-        if (fmt.fmt.pix.bytesperline < min)
-                fmt.fmt.pix.bytesperline = min;
-        min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-        if (fmt.fmt.pix.sizeimage < min)
-                fmt.fmt.pix.sizeimage = min;
-
-        switch (io) {
-        case IO_METHOD_READ:
-                init_read(fmt.fmt.pix.sizeimage);
-                break;
-
-        case IO_METHOD_MMAP:
-                init_mmap();
-                break;
+        if (golden_fp) {
+            // What the detector saw, then what was left of it after despeckling and noisy cells.
+            memcpy(result, movment_buf, cells);
+            memcpy(result + cells, motion_mask.bits, mask_bytes);
+            memcpy(result + cells + mask_bytes, &blob_count, sizeof(int));
+            memcpy(result + cells + mask_bytes + sizeof(int), &peak_blob, sizeof(int));
+            if (recording) {
+                fwrite(result, golden_size, 1, golden_fp);
+            } else if (fread(expected, golden_size, 1, golden_fp) != 1) {
+                fprintf(stderr, "frame %i: missing from %s\n", frame_num, golden_name);
+                failed = 1;
+            } else if (memcmp(result, expected, golden_size)) {
+                fprintf(stderr, "frame %i: detector output differs from %s\n", frame_num, golden_name);
+                failed = 1;
+            }
+        }
+        frame_num++;
+    }
 
-        case IO_METHOD_USERPTR:
-                init_userp(fmt.fmt.pix.sizeimage);
-                break;
+    fprintf(stderr, "replayed %i frames of %ix%i\n", frame_num, capture_width, capture_height);
+    fprintf(stderr, "converter worst error: %i\n", worst_error);
+    if (worst_error > 1) {
+        failed = 1;
+    }
+    if (frame_num) {
+        struct timespec last = { (frame_num - 1) / 10, ((frame_num - 1) % 10) * (BILLION / 10) };
+        report_modes(stderr, (long long)last.tv_sec * BILLION + last.tv_nsec);
+        report_crops(stderr);
+    }
+    for (i = 0; i < NUM_STAGES; i++) {
+        stage_report(stderr, stages[i]);
+        if (stage_over_budget(stages[i])) {
+            failed = 1;
         }
+    }
+    arena_report(stderr, &work_arena);
+    if (recording) {
+        fprintf(stderr, "wrote %s\n", golden_name);
+    }
 
-	capture_width = fmt.fmt.pix.width;
-	capture_height = fmt.fmt.pix.height;
-    fprintf(stderr,"Image width set to %i by device %s.\n", capture_width, dev_name);
-    fprintf(stderr,"Image height set to %i by device %s.\n", capture_height, dev_name);
+    fclose(replay_fp);
+    if (golden_fp) {
+        fclose(golden_fp);
+    }
+    free(frame);
+    free(result);
+    free(expected);
+    uninit_buf();
+    close_outputs();
 
-    // Turn off anything that might auto-adjust the brightness/contrast.
-    // "$ v4l2-ctl -l" lets us see what our camera is capable of (and set to).
-    memset (&control, 0, sizeof (control));
-    control.id = V4L2_CID_AUTO_WHITE_BALANCE;
-    control.value = 0;
-    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
-    memset (&control, 0, sizeof (control));
-    control.id = V4L2_CID_RED_BALANCE;
-    control.value = 0;
-    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
-    memset (&control, 0, sizeof (control));
-    control.id = V4L2_CID_BLUE_BALANCE;
-    control.value = 0;
-    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
-    memset (&control, 0, sizeof (control));
-    control.id = V4L2_CID_AUTOGAIN;
-    control.value = 0;
-    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
-    memset (&control, 0, sizeof (control));
-    control.id = V4L2_CID_HUE_AUTO;
-    control.value = 0;
-    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
-    memset (&control, 0, sizeof (control));
-    control.id =  V4L2_CID_BACKLIGHT_COMPENSATION;
-    control.value = 0;
-    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
-    memset (&control, 0, sizeof (control));
-    control.id =  V4L2_EXPOSURE_AUTO;
-    control.value = 3;
-    ioctl (fd, VIDIOC_S_CTRL, &control);    // Errors ignored
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-static void close_device(void)
+/* Parse a comma separated list of CPUs into worker_cpus. Returns -1 if it is not one. */
+static int set_worker_cpus(char* arg)
 {
-        if (-1 == close(fd))
-                errno_exit("close");
+    char *tok, *save;
 
-        fd = -1;
+    n_worker_cpus = 0;
+    for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (n_worker_cpus == CPU_SETSIZE || *tok < '0' || *tok > '9') {
+            return -1;
+        }
+        worker_cpus[n_worker_cpus++] = atoi(tok);
+    }
+    return n_worker_cpus ? 0 : -1;
 }
 
-static void open_device(void)
+/* Add a rendition from a "denominator:seconds:quality[:motion]" argument, eg. 8:1:50.
+ * Returns -1 if the argument is malformed or there are already MAX_RENDITIONS.
+ */
+static int add_rendition(const char* arg)
 {
-        struct stat st;
-
-        if (-1 == stat(dev_name, &st)) {
-                fprintf(stderr, "Cannot identify '%s': %d, %s\n",
-                         dev_name, errno, strerror(errno));
-                exit(EXIT_FAILURE);
-        }
-
-        if (!S_ISCHR(st.st_mode)) {
-                fprintf(stderr, "%s is no device\n", dev_name);
-                exit(EXIT_FAILURE);
-        }
+    struct rendition* r = &renditions[n_renditions];
+    int denom, used = 0;
 
-        fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
-
-        if (-1 == fd) {
-                fprintf(stderr, "Cannot open '%s': %d, %s\n",
-                         dev_name, errno, strerror(errno));
-                exit(EXIT_FAILURE);
-        }
-}
-
-void get_rgb(struct screen_buf* rgb_out){
-    if(rgb_out->length == 0){
-        rgb_out->start = malloc(sizeof(unsigned char) * last_frame.width * last_frame.height * 3);
-    } else if(rgb_out->length < sizeof(unsigned char) * last_frame.width * last_frame.height * 3){
-        rgb_out->length = sizeof(unsigned char) * last_frame.width * last_frame.height * 3;
-        rgb_out->start = realloc(rgb_out->start, rgb_out->length);
+    if (n_renditions == MAX_RENDITIONS ||
+            sscanf(arg, "%i:%lf:%i%n", &denom, &r->interval, &r->quality, &used) != 3) {
+        return -1;
     }
-    if(!rgb_out->start){
-        fprintf(stderr, "Memory error!");
-        exit(1);
+    if (!strcmp(arg + used, ":motion")) {
+        r->motion_only = 1;
+    } else if (arg[used]) {
+        return -1;
     }
-    rgb_out->width = last_frame.width;
-    rgb_out->height = last_frame.height;
-    
-    YUV422toRGB888(last_frame.width, last_frame.height, last_frame.start, rgb_out->start);    
+    if (denom < 1 || (denom & (denom - 1)) || r->interval < 0 || r->quality < 0 || r->quality > 100) {
+        return -1;
+    }
+    r->level = __builtin_ctz(denom);
+    if (r->level >= PYRAMID_LEVELS) {
+        return -1;
+    }
+    r->last_ns = -1;
+    if (r->level) {
+        snprintf(r->filename, sizeof(r->filename), "peep_webcam_%i.jpeg", denom);
+    } else {
+        strcpy(r->filename, "peep_webcam.jpeg");
+    }
+    if (r->level > pyramid_depth) {
+        pyramid_depth = r->level;
+    }
+    n_renditions++;
+    return 0;
 }
 
-void get_jpeg(){
+/* Set the budget of a stage from a "name=ns" argument. Returns -1 if there is no such stage. */
+static int set_budget(const char* arg)
+{
+    unsigned int i;
+    const char* eq = strchr(arg, '=');
 
+    if (!eq) {
+        return -1;
+    }
+    for (i = 0; i < NUM_STAGES; i++) {
+        if (strlen(stages[i]->name) == (size_t)(eq - arg) && !strncmp(stages[i]->name, arg, eq - arg)) {
+            stages[i]->budget_ns = atoll(eq + 1);
+            return 0;
+        }
+    }
+    return -1;
 }
 
 static void usage(FILE *fp, int argc, char **argv)
@@ -852,17 +3122,73 @@ static void usage(FILE *fp, int argc, char **argv)
                  "-r | --read          Use read() calls\n"
                  "-u | --userp         Use application allocated buffers\n"
                  "-f | --format        Force format to 640x480 YUYV\n"
+                 "-W | --detect WxH    Capture the cheapest mode of at least this size for detection.\n"
+                 "                     YUYV, NV12, YUV420 and GREY are supported, single or multi-planar.\n"
+                 "-F | --fps           Frame rate the --detect mode must reach [%u]\n"
+                 "-p | --snapshot      Switch to full resolution for peep_snapshot.jpeg on movment,\n"
+                 "                     at most once every this many seconds. 0 = off [%i]\n"
+                 "-D | --detector      Movment detector. One of:\n"
+                 "                     average: difference from a slowly updated background [default]\n"
+                 "                     sad:     difference from the previous frame\n"
+                 "                     gauss:   distance from a per cell mean and variance\n"
+                 "-y | --sigma         Standard deviations from the mean that count as movment. (gauss) [%.1f]\n"
                  "-s | --scale         Raw image devided by this scale [%i]\n"
+                 "-S | --stats         Print stage timings every this many seconds. 0 = off [%i]\n"
+                 "-X | --index file    Append per second movment stats to this index. See peep_index.c\n"
+                 "-Y | --record file   Append the Jpeg of every frame with movment to this segment\n"
+                 "-K | --crop seconds  Record only MCU aligned crops around the movment, at --quality, and\n"
+                 "                     a quality %i full frame at most every this many seconds [%i]\n"
+                 "-g | --gain n        Split the frame into n x n regions and scale each to the brightness\n"
+                 "                     of the background before comparing. 0 = off [%i]\n"
+                 "-E | --flood percent Movment over more than this much of the frame is a lighting change:\n"
+                 "                     no event, and the frame becomes the background. 0 = off [%i]\n"
+                 "-N | --noisy percent Cells that moved more than this much of the last few minutes stop\n"
+                 "                     triggering until they drop below half of it. The activity of every\n"
+                 "                     cell is written to peep_heatmap.jpeg, noisy ones red. 0 = off [%i]\n"
+                 "-k | --despeckle     Ignore movment cells without a 3x3 block of movment around them\n"
+                 "-M | --mask          Write the movment cells of each frame to peep_movment.rle\n"
+                 "-e | --stale         Report a stale feed after this many identical frames. 0 = never [%i]\n"
+                 "-H | --sha256        Add a SHA-256 of the frame to event lines\n"
+                 "-C | --cpu           Pin the capture thread to this CPU. Its buffers are then also on\n"
+                 "                     that CPU's NUMA node, otherwise on whichever node it started on\n"
+                 "-w | --workers       Worker threads for Jpeg encoding [%i]\n"
+                 "-x | --worker_cpus   Pin worker threads to these CPUs, eg. 2,3\n"
+                 "-q | --quality       Jpeg quality, 0 to 100 [%i]\n"
+                 "-l | --slices        Split each Jpeg into this many slices, encoded in parallel [%i]\n"
+                 "-t | --rendition d:s:q[:motion]\n"
+                 "                     Write the frame at 1/d size (d a power of 2) to peep_webcam_d.jpeg,\n"
+                 "                     or peep_webcam.jpeg for 1/1, at most every s seconds (0 = every frame)\n"
+                 "                     at quality q, and with :motion only on movment. Repeatable, all come\n"
+                 "                     from one downscale per frame. [1:0:--quality]\n"
+                 "-T | --rt_prio       Run the capture thread under SCHED_FIFO at this priority (1-99)\n"
+                 "-L | --lock          Lock all memory and prefault buffers at startup\n"
+                 "-P | --hugepages     Back frame and detection buffers with 2MB pages where there are any.\n"
+                 "                     Use with --cpu for the pages to be local to the capture thread\n"
+                 "-I | --idle_after    Seconds without movment before dropping to --idle_fps with coarse,\n"
+                 "                     luma only detection. 0 = never [%i]\n"
+                 "-i | --idle_fps      Frame rate while idle [%i]\n"
+                 "-O | --cache file    Keep the negotiated format here, and skip enumerating the device's\n"
+                 "                     formats, sizes and frame rates when it has not been replugged\n"
+                 "-U | --share socket  Offer every captured buffer as a dmabuf to consumers on this Unix\n"
+                 "                     socket. See peep_share.c. Needs --mmap, not --snapshot.\n"
+                 "-A | --batch dir     Run the Jpegs in this directory through the detector (not sad), oldest\n"
+                 "                     first, instead of a device. Decoded in parallel on the --workers.\n"
+                 "-j | --bench         Time the detection kernel at every scale on --size noise [640x480]\n"
+                 "-R | --replay file   Run a raw YUYV clip instead of a device. Needs --size.\n"
+                 "-Z | --size WxH      Frame size of the --replay clip\n"
+                 "-G | --golden file   Compare --replay detector output with this file (written if missing)\n"
+                 "-B | --budget s=ns   Fail --replay if stage s (convert, detect, encode) has a higher\n"
+                 "                     mean ns per frame\n"
                  "-a | --ave_thresh    Rate at which changes in image are absorbed into the expected backround [%f]\n"
                  "-b | --bright_thresh Sensitivity to movment. 0 = high sensitivity. 255 = no sensitivity [%i]\n"
                  "                     Lower this if contrast is bad but colours are different.\n"
                  "-c | --col_thresh    Sensitivity to movment. 0 = high sensitivity. 255 = no sensitivity [%i]\n"
                  "                     Lower this if detected colours are similar to background.\n"
                  "",
-                 argv[0], dev_name, scale, ave_thresh, bright_thresh, col_thresh);
+                 argv[0], dev_name, detect_fps, snapshot_interval, sigma, scale, stats_interval, CONTEXT_QUALITY, context_interval, gain_regions, flood_percent, noisy_percent, stale_after, workers, jpeg_quality, jpeg_slices, idle_after, idle_fps, ave_thresh, bright_thresh, col_thresh);
 }
 
-static const char short_options[] = "d:hmruofs:a:b:c:";
+static const char short_options[] = "d:hmruofW:F:p:D:y:s:S:X:Y:K:g:E:N:kMe:HO:U:A:jC:w:x:q:l:t:T:LPI:i:R:Z:G:B:a:b:c:";
 
 static const struct option
 long_options[] = {
@@ -872,7 +3198,42 @@ long_options[] = {
         { "read",   no_argument,       NULL, 'r' },
         { "userp",  no_argument,       NULL, 'u' },
         { "format", no_argument,       NULL, 'f' },
+        { "detect", required_argument, NULL, 'W' },
+        { "fps",    required_argument, NULL, 'F' },
+        { "snapshot", required_argument, NULL, 'p' },
+        { "detector", required_argument, NULL, 'D' },
+        { "sigma",  required_argument, NULL, 'y' },
         { "scale",  required_argument, NULL, 's' },
+        { "stats",  required_argument, NULL, 'S' },
+        { "cpu",    required_argument, NULL, 'C' },
+        { "index",  required_argument, NULL, 'X' },
+        { "record", required_argument, NULL, 'Y' },
+        { "crop",   required_argument, NULL, 'K' },
+        { "gain",   required_argument, NULL, 'g' },
+        { "flood",  required_argument, NULL, 'E' },
+        { "noisy",  required_argument, NULL, 'N' },
+        { "despeckle", no_argument,    NULL, 'k' },
+        { "mask",   no_argument,       NULL, 'M' },
+        { "stale",  required_argument, NULL, 'e' },
+        { "sha256", no_argument,       NULL, 'H' },
+        { "workers", required_argument, NULL, 'w' },
+        { "worker_cpus", required_argument, NULL, 'x' },
+        { "quality", required_argument, NULL, 'q' },
+        { "slices", required_argument, NULL, 'l' },
+        { "rendition", required_argument, NULL, 't' },
+        { "rt_prio", required_argument, NULL, 'T' },
+        { "lock",   no_argument,       NULL, 'L' },
+        { "hugepages", no_argument,    NULL, 'P' },
+        { "idle_after", required_argument, NULL, 'I' },
+        { "idle_fps", required_argument, NULL, 'i' },
+        { "replay", required_argument, NULL, 'R' },
+        { "size",   required_argument, NULL, 'Z' },
+        { "golden", required_argument, NULL, 'G' },
+        { "batch",  required_argument, NULL, 'A' },
+        { "share",  required_argument, NULL, 'U' },
+        { "cache",  required_argument, NULL, 'O' },
+        { "bench",  no_argument,       NULL, 'j' },
+        { "budget", required_argument, NULL, 'B' },
         { "ave_thresh", required_argument, NULL, 'a' },
         { "bright_thresh", required_argument, NULL, 'b' },
         { "col_thresh", required_argument, NULL, 'c' },
@@ -881,8 +3242,9 @@ long_options[] = {
 
 int main(int argc, char **argv)
 {
-    struct timespec begin, end;
+    struct timespec begin, end, stats_begin;
 
+    startup_ns = now_ns();
     dev_name = "/dev/video0";
 
     for (;;) {
@@ -922,7 +3284,51 @@ int main(int argc, char **argv)
             case 'f':
                 force_format++;
                 break;
+
+            case 'W':
+                if (2 != sscanf(optarg, "%ux%u", &detect_width, &detect_height)) {
+                    fprintf(stderr, "--detect must look like 320x240\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'F':
+                detect_fps = atoi(optarg);
+                if (!detect_fps) {
+                    fprintf(stderr, "--fps must be above 0\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'p':
+                snapshot_interval = atoi(optarg);
+                break;
             
+            case 'D':
+                if (!strcmp(optarg, "average")) {
+                    detector = DETECTOR_AVERAGE;
+                } else if (!strcmp(optarg, "sad")) {
+                    detector = DETECTOR_SAD;
+                } else if (!strcmp(optarg, "gauss")) {
+                    detector = DETECTOR_GAUSS;
+                } else {
+                    fprintf(stderr, "--detector must be one of [average,sad,gauss]\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'y':
+                sigma = atof(optarg);
+                if (sigma <= 0) {
+                    fprintf(stderr, "--sigma must be more than 0\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
             case 's':
                 scale = atoi(optarg);
                 if (!((scale == 1) | (scale == 2) | (scale == 4) | (scale == 8) | (scale == 16) |
@@ -933,6 +3339,185 @@ int main(int argc, char **argv)
                 }
                 break;
 
+            case 'S':
+                stats_interval = atoi(optarg);
+                break;
+
+            case 'C':
+                capture_cpu = atoi(optarg);
+                break;
+
+            case 'X':
+                index_name = optarg;
+                break;
+
+            case 'Y':
+                record_name = optarg;
+                break;
+
+            case 'K':
+                crop_mode = 1;
+                context_interval = atoi(optarg);
+                if (context_interval < 0) {
+                    fprintf(stderr, "--crop must not be negative\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'g':
+                gain_regions = atoi(optarg);
+                if (gain_regions < 0) {
+                    fprintf(stderr, "--gain must not be negative\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'E':
+                flood_percent = atoi(optarg);
+                if (flood_percent < 0 || flood_percent > 100) {
+                    fprintf(stderr, "--flood must be between 0 and 100\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'N':
+                noisy_percent = atoi(optarg);
+                if (noisy_percent < 0 || noisy_percent > 100) {
+                    fprintf(stderr, "--noisy must be between 0 and 100\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'k':
+                despeckle++;
+                break;
+
+            case 'M':
+                export_mask++;
+                break;
+
+            case 'e':
+                stale_after = atoi(optarg);
+                break;
+
+            case 'H':
+                audit_sha256++;
+                break;
+
+            case 'w':
+                workers = atoi(optarg);
+                break;
+
+            case 'x':
+                if (set_worker_cpus(optarg)) {
+                    fprintf(stderr, "--worker_cpus must look like 2,3\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'q':
+                jpeg_quality = atoi(optarg);
+                if (jpeg_quality < 0 || jpeg_quality > 100) {
+                    fprintf(stderr, "--quality must be between 0 and 100\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'l':
+                jpeg_slices = atoi(optarg);
+                if (jpeg_slices < 1) {
+                    fprintf(stderr, "--slices must be at least 1\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 't':
+                if (add_rendition(optarg)) {
+                    fprintf(stderr, "--rendition must look like 8:1:50 or 1:0:80:motion\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'T':
+                rt_priority = atoi(optarg);
+                if (rt_priority < sched_get_priority_min(SCHED_FIFO) ||
+                        rt_priority > sched_get_priority_max(SCHED_FIFO)) {
+                    fprintf(stderr, "--rt_prio must be between %i and %i\n\n",
+                            sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'L':
+                lock_memory++;
+                break;
+
+            case 'P':
+                huge_pages++;
+                break;
+
+            case 'I':
+                idle_after = atoi(optarg);
+                break;
+
+            case 'i':
+                idle_fps = atoi(optarg);
+                if (idle_fps <= 0) {
+                    fprintf(stderr, "--idle_fps must be above 0\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'R':
+                replay_name = optarg;
+                break;
+
+            case 'A':
+                batch_name = optarg;
+                break;
+
+            case 'U':
+                share_name = optarg;
+                break;
+
+            case 'O':
+                cache_name = optarg;
+                break;
+
+            case 'j':
+                bench_mode++;
+                break;
+
+            case 'Z':
+                if (2 != sscanf(optarg, "%ix%i", &capture_width, &capture_height)) {
+                    fprintf(stderr, "--size must look like 320x240\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'G':
+                golden_name = optarg;
+                break;
+
+            case 'B':
+                if (set_budget(optarg)) {
+                    fprintf(stderr, "--budget must look like detect=100000\n\n");
+                    usage(stderr, argc, argv);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
             case 'a':
                 ave_thresh = atof(optarg);
                 break;
@@ -960,37 +3545,117 @@ int main(int argc, char **argv)
     rgb_frame.start = 0;
     rgb_frame.length = 0;
 
+    struct screen_buf snapshot_frame;
+    snapshot_frame.start = 0;
+    snapshot_frame.length = 0;
+
+    if (!n_renditions) {
+        // Just peep_webcam.jpeg, every frame, as before --rendition.
+        char arg[16];
+        snprintf(arg, sizeof(arg), "1:0:%i", jpeg_quality);
+        add_rendition(arg);
+    }
+
+    if (crop_mode && !record_name) {
+        fprintf(stderr, "--crop needs --record\n\n");
+        exit(EXIT_FAILURE);
+    }
+
+    capture_arena.huge = work_arena.huge = huge_pages;
+
+    // Workers start before set_realtime() so they do not inherit SCHED_FIFO or the capture CPU.
+    pool_init(workers, n_worker_cpus ? worker_cpus : NULL, n_worker_cpus);
+    open_outputs();
+
+    if (bench_mode) {
+        if (!capture_width || !capture_height) {
+            capture_width = 640;
+            capture_height = 480;
+        }
+        return bench();
+    }
+    if (batch_name) {
+        if (detector == DETECTOR_SAD) {
+            fprintf(stderr, "--batch does not work with --detector sad\n\n");
+            exit(EXIT_FAILURE);
+        }
+        return batch();
+    }
+    if (replay_name) {
+        pix_format = find_pix_format(V4L2_PIX_FMT_YUYV);
+        if (!capture_width || !capture_height) {
+            fprintf(stderr, "--replay needs --size\n\n");
+            usage(stderr, argc, argv);
+            exit(EXIT_FAILURE);
+        }
+        return replay(&rgb_frame, &snapshot_frame);
+    }
+
+    if (share_name && (io != IO_METHOD_MMAP || snapshot_interval)) {
+        fprintf(stderr, "--share needs --mmap and no --snapshot\n\n");
+        exit(EXIT_FAILURE);
+    }
+
+    startup_phase("setup");
+    set_realtime();
+    startup_phase("set_realtime");
     open_device();
+    startup_phase("open_device");
     init_device();
-    init_buf();
+    if (share_name) {
+        export_buffers();
+    }
+    startup_phase("init_device");
+    // The sensor takes a while to deliver its first frame, so set up our own
+    // buffers after starting it rather than before.
     start_capturing();
-    clock_gettime( CLOCK_REALTIME, &begin);
+    startup_phase("start_capturing");
+    init_buf();
+    if (lock_memory) {
+        prefault(&rgb_frame);
+    }
+    startup_phase("init_buf");
+    clock_gettime( CLOCK_REALTIME, &stats_begin);
+    begin.tv_sec = begin.tv_nsec = 0;       // Take the first frame as soon as it comes.
+    int first_frame = 1;
+    int first_detection_done = 0;
     while (1) {
         mainloop();
+        if (first_frame) {
+            startup_phase("first_frame");
+            first_frame = 0;
+        }
         clock_gettime( CLOCK_REALTIME, &end);
-        if ((end.tv_sec - begin.tv_sec) + ((double)(end.tv_nsec - begin.tv_nsec) / (double)BILLION) > 0.1) {
+        if (!first_detection_done ||
+                (end.tv_sec - begin.tv_sec) + ((double)(end.tv_nsec - begin.tv_nsec) / (double)BILLION) > frame_interval()) {
+            // Until the first frame after the one that seeds the background has
+            // been through detection, every frame is taken.
+            int seeded = !first_run;
             clock_gettime( CLOCK_REALTIME, &begin);
             //fprintf(stderr, ".\n");
-            //YUV422toRGB888(capture_width, capture_height, last_frame.start, rgb_buf);
-            get_rgb(&rgb_frame);
-            
-            //update_movment(rgb_buf);
-            update_movment(rgb_frame.start);
-            display_image(movment_buf);
-            write_JPEG_file("peep_webcam.jpeg", rgb_frame.start, rgb_frame.width, rgb_frame.height, 3);
-            
-            //float_buf_to_char_buf(average_buf, average_char_buf, capture_width / scale, capture_height / scale, 3);
-            //write_JPEG_file("peep_average.jpeg", average_char_buf, capture_width / scale, capture_height / scale, 3);
-            
-            //write_JPEG_file("peep_movment.jpeg", movment_buf, capture_width / scale, capture_height / scale, 1);
-
-            first_run = 0;
+            if (process_frame(&rgb_frame, &snapshot_frame, &end) && seeded && !first_detection_done) {
+                startup_phase("first_detection");
+                first_detection_done = 1;
+            }
+        }
+        if (stats_interval && end.tv_sec - stats_begin.tv_sec >= stats_interval) {
+            unsigned int i;
+            stats_begin = end;
+            for (i = 0; i < NUM_STAGES; i++) {
+                stage_report(stderr, stages[i]);
+            }
+            report_modes(stderr, (long long)end.tv_sec * BILLION + end.tv_nsec);
+            report_crops(stderr);
+            arena_report(stderr, &capture_arena);
+            arena_report(stderr, &work_arena);
         }
     }
     stop_capturing();
+    share_close();
     uninit_buf();
     uninit_device();
     close_device();
+    close_outputs();
     fprintf(stderr, "\n");
     return 0;
 }